@@ -0,0 +1,34 @@
+#ifndef COMMON_AGGREGATE_H
+#define COMMON_AGGREGATE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Per-entity aggregation of values collected during a tick, shared by the game loops.
+namespace aggregate {
+
+//Sorts (key, amount) pairs by key and merges each run of equal keys into one entry whose
+//amount is their sum, saturating at max_amount. The vector keeps its capacity, so calling
+//this every tick doesn't allocate once it has grown.
+template <typename Key, typename Amount>
+void SumByKey(std::vector<std::pair<Key, Amount>>& entries, Amount max_amount = std::numeric_limits<Amount>::max()) {
+    std::sort(entries.begin(), entries.end());
+
+    std::size_t merged = 0;
+    for (std::size_t i = 0; i < entries.size(); i++) {
+        if (merged > 0 && entries[merged - 1].first == entries[i].first) {
+            Amount& amount = entries[merged - 1].second;
+            amount = amount > max_amount - entries[i].second ? max_amount : amount + entries[i].second;
+        } else {
+            entries[merged++] = entries[i];
+        }
+    }
+    entries.resize(merged);
+}
+
+}
+
+#endif
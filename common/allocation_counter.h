@@ -0,0 +1,107 @@
+#ifndef COMMON_ALLOCATION_COUNTER_H
+#define COMMON_ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <new>
+
+// Debug counter for heap allocations made by the game loop tick.
+//
+// Built with -DCOUNT_ALLOCATIONS=ON, this replaces the global operator new so every allocation
+// is counted, and TickCheck reports the allocations made by each tick. A tick is expected to
+// allocate a bounded amount no matter how many entities it touches.
+//
+// Only steady ticks are compared, where the entity count is the same as in the tick before.
+// Ticks that add entities also fill new buffer capacity and map nodes once. The steady tick
+// with the fewest entities is the baseline. In debug builds TickCheck asserts when a steady
+// tick has at least kGrowthFactor times the baseline entities, and kMinimumEntityGrowth more,
+// and makes at least one extra allocation for every two extra entities. A few capacity
+// doublings can't reach that, but a per-entity allocation does. Without COUNT_ALLOCATIONS,
+// TickCheck compiles to nothing.
+//
+// Because it defines operator new, include this header from a single source file per worker.
+namespace allocation_counter {
+
+inline std::atomic<std::uint64_t>& Count() {
+    static std::atomic<std::uint64_t> count{0};
+    return count;
+}
+
+class TickCheck {
+    public:
+        static const std::size_t kGrowthFactor = 2;
+        static const std::size_t kMinimumEntityGrowth = 64;
+
+        TickCheck() : tick_start_(0), previous_entities_(std::numeric_limits<std::size_t>::max()), has_baseline_(false), baseline_entities_(0), baseline_allocations_(0) {}
+
+    void Begin() {
+#ifdef COUNT_ALLOCATIONS
+        tick_start_ = Count().load(std::memory_order_relaxed);
+#endif
+    }
+
+    void End(std::size_t entity_count) {
+#ifdef COUNT_ALLOCATIONS
+        std::uint64_t allocations = Count().load(std::memory_order_relaxed) - tick_start_;
+        std::cout << "[local] Tick made " << allocations << " heap allocations for " << entity_count << " entities" << std::endl;
+
+        //The first tick, and ticks that add entities, fill the reusable buffers
+        bool steady = entity_count == previous_entities_;
+        previous_entities_ = entity_count;
+        if (!steady) {
+            return;
+        }
+        if (!has_baseline_ || entity_count < baseline_entities_ ||
+            (entity_count == baseline_entities_ && allocations < baseline_allocations_)) {
+            has_baseline_ = true;
+            baseline_entities_ = entity_count;
+            baseline_allocations_ = allocations;
+            return;
+        }
+
+        bool far_from_baseline = entity_count >= kGrowthFactor * baseline_entities_ &&
+                                 entity_count - baseline_entities_ >= kMinimumEntityGrowth;
+        if (far_from_baseline && allocations > baseline_allocations_) {
+            bool grows_with_entities = 2 * (allocations - baseline_allocations_) >= entity_count - baseline_entities_;
+            if (grows_with_entities) {
+                std::cerr << "[local] Tick allocations grew from " << baseline_allocations_ << " for "
+                          << baseline_entities_ << " entities to " << allocations << " for "
+                          << entity_count << " entities" << std::endl;
+            }
+            assert(!grows_with_entities && "Tick heap allocations grow with entity count");
+        }
+#else
+        (void) entity_count;
+#endif
+    }
+
+    private:
+        std::uint64_t tick_start_;
+        std::size_t previous_entities_;
+        bool has_baseline_;
+        std::size_t baseline_entities_;
+        std::uint64_t baseline_allocations_;
+};
+
+}
+
+#ifdef COUNT_ALLOCATIONS
+void* operator new(std::size_t size) {
+    allocation_counter::Count().fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+#endif
+
+#endif
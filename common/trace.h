@@ -0,0 +1,297 @@
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped tracing of the worker game loop.
+//
+// Each thread records completed scopes into its own fixed size ring buffer. When tracing is
+// disabled (the default) a scope costs one relaxed atomic load. When a trigger fires, the last
+// N frames are written out as Chrome trace-event JSON, which can be opened in Perfetto
+// (https://ui.perfetto.dev) or chrome://tracing.
+//
+// Triggers:
+//   --trace_frames=<N>         enables tracing, keeping the last N frames (dumped on exit)
+//   --trace_slow_tick_ms=<ms>  dumps when a frame takes longer than <ms>
+//   --trace_file=<path>        where dumps are written
+//   SIGUSR1                    dumps at the end of the current frame (POSIX only)
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+// Upper bound on the events kept per thread, older events are overwritten
+const std::size_t kEventsPerThread = 1 << 16;
+
+struct Event {
+    //Names and categories must be string literals, they are stored as pointers
+    const char* name;
+    const char* category;
+    std::int64_t start_ns;
+    std::int64_t duration_ns;
+    std::uint64_t frame;
+};
+
+class ThreadBuffer {
+    public:
+        explicit ThreadBuffer(std::uint32_t id) : thread_id(id), events_(kEventsPerThread), next_(0), size_(0) {}
+
+        const std::uint32_t thread_id;
+
+    void Record(const Event& event) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_[next_] = event;
+        next_ = (next_ + 1) % events_.size();
+        size_ = std::min(size_ + 1, events_.size());
+    }
+
+    //Appends every event from first_frame onwards
+    void CopySince(std::uint64_t first_frame, std::vector<std::pair<std::uint32_t, Event>>& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::size_t oldest = (next_ + events_.size() - size_) % events_.size();
+        for (std::size_t i = 0; i < size_; i++) {
+            const Event& event = events_[(oldest + i) % events_.size()];
+            if (event.frame >= first_frame) {
+                out.emplace_back(thread_id, event);
+            }
+        }
+    }
+
+    private:
+        mutable std::mutex mutex_;
+        std::vector<Event> events_;
+        std::size_t next_;
+        std::size_t size_;
+};
+
+struct State {
+    State() : enabled(false), frame(0), frames_to_keep(0), slow_tick_ns(0), last_dump_frame(0), epoch(Clock::now()) {}
+
+    std::atomic<bool> enabled;
+    std::atomic<std::uint64_t> frame;
+    std::uint64_t frames_to_keep;
+    std::int64_t slow_tick_ns;
+    std::uint64_t last_dump_frame;
+    Clock::time_point epoch;
+    Clock::time_point frame_start;
+    std::string file;
+
+    //Buffers outlive their threads so a dump still sees events from threads that have exited
+    std::mutex buffers_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+};
+
+inline State& GetState() {
+    static State state;
+    return state;
+}
+
+inline volatile std::sig_atomic_t& DumpRequested() {
+    static volatile std::sig_atomic_t dump_requested = 0;
+    return dump_requested;
+}
+
+inline bool Enabled() {
+    return GetState().enabled.load(std::memory_order_relaxed);
+}
+
+inline std::int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - GetState().epoch).count();
+}
+
+inline ThreadBuffer& LocalBuffer() {
+    static thread_local std::shared_ptr<ThreadBuffer> buffer;
+    if (!buffer) {
+        State& state = GetState();
+        std::lock_guard<std::mutex> lock(state.buffers_mutex);
+        buffer = std::make_shared<ThreadBuffer>(static_cast<std::uint32_t>(state.buffers.size() + 1));
+        state.buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+// Records the time from construction until End() or destruction, whichever comes first
+class Scope {
+    public:
+        explicit Scope(const char* name, const char* category = "loop") : name_(nullptr), category_(category), start_ns_(0) {
+            if (Enabled()) {
+                name_ = name;
+                start_ns_ = NowNs();
+            }
+        }
+
+        ~Scope() {
+            End();
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    void End() {
+        if (name_) {
+            LocalBuffer().Record(Event{name_, category_, start_ns_, NowNs() - start_ns_, GetState().frame.load(std::memory_order_relaxed)});
+            name_ = nullptr;
+        }
+    }
+
+    private:
+        const char* name_;
+        const char* category_;
+        std::int64_t start_ns_;
+};
+
+inline void WriteJsonString(std::ostream& out, const char* text) {
+    out << '"';
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out << '\\';
+        }
+        out << *c;
+    }
+    out << '"';
+}
+
+// Writes the last frames_to_keep frames of every thread as Chrome trace-event JSON
+inline bool Dump() {
+    State& state = GetState();
+    std::uint64_t current_frame = state.frame.load();
+    std::uint64_t first_frame = current_frame >= state.frames_to_keep ? current_frame - state.frames_to_keep + 1 : 0;
+
+    std::vector<std::pair<std::uint32_t, Event>> events;
+    {
+        std::lock_guard<std::mutex> lock(state.buffers_mutex);
+        for (const auto& buffer : state.buffers) {
+            buffer->CopySince(first_frame, events);
+        }
+    }
+
+    //Each dump gets its own file, e.g. Managed_trace_frame42.json
+    std::string file = state.file;
+    std::string suffix = "_frame" + std::to_string(current_frame);
+    std::size_t extension = file.rfind('.');
+    if (extension == std::string::npos || file.find_first_of("/\\", extension) != std::string::npos) {
+        extension = file.size();
+    }
+    file.insert(extension, suffix);
+
+    std::ofstream out(file.c_str(), std::ios::trunc);
+    if (!out) {
+        std::cerr << "[local] Failed to open trace file " << file << std::endl;
+        return false;
+    }
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const Event& event = events[i].second;
+        out << (i == 0 ? "\n" : ",\n") << "{\"name\":";
+        WriteJsonString(out, event.name);
+        out << ",\"cat\":";
+        WriteJsonString(out, event.category);
+        out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << events[i].first
+            << ",\"ts\":" << event.start_ns / 1000 << '.' << event.start_ns % 1000 / 100
+            << ",\"dur\":" << event.duration_ns / 1000 << '.' << event.duration_ns % 1000 / 100
+            << ",\"args\":{\"frame\":" << event.frame << "}}";
+    }
+    out << "\n]}\n";
+
+    state.last_dump_frame = current_frame;
+    std::cout << "[local] Wrote trace of frames " << first_frame << "-" << current_frame
+              << " (" << events.size() << " events) to " << file << std::endl;
+    return true;
+}
+
+inline void HandleDumpSignal(int) {
+    DumpRequested() = 1;
+}
+
+// Removes the --trace_* flags from arguments and configures tracing from them
+inline void ConsumeFlags(std::vector<std::string>& arguments, const std::string& default_file) {
+    State& state = GetState();
+    state.file = default_file;
+    DumpRequested() = 0;
+
+    auto value_of = [](const std::string& argument, const std::string& flag) -> const char* {
+        return argument.compare(0, flag.size(), flag) == 0 ? argument.c_str() + flag.size() : nullptr;
+    };
+
+    std::vector<std::string> remaining;
+    for (const auto& argument : arguments) {
+        if (const char* frames = value_of(argument, "--trace_frames=")) {
+            state.frames_to_keep = std::strtoull(frames, nullptr, 10);
+        } else if (const char* slow_tick_ms = value_of(argument, "--trace_slow_tick_ms=")) {
+            state.slow_tick_ns = std::strtoll(slow_tick_ms, nullptr, 10) * 1000000;
+        } else if (const char* file = value_of(argument, "--trace_file=")) {
+            state.file = file;
+        } else {
+            remaining.push_back(argument);
+        }
+    }
+    arguments.swap(remaining);
+
+    //A slow tick threshold on its own still needs some history to dump
+    if (state.slow_tick_ns > 0 && state.frames_to_keep == 0) {
+        state.frames_to_keep = 10;
+    }
+
+    if (state.frames_to_keep > 0) {
+        state.enabled = true;
+#ifdef SIGUSR1
+        std::signal(SIGUSR1, HandleDumpSignal);
+#endif
+        std::cout << "[local] Tracing the last " << state.frames_to_keep << " frames to " << state.file << std::endl;
+    }
+}
+
+inline void BeginFrame() {
+    State& state = GetState();
+    if (state.enabled.load(std::memory_order_relaxed)) {
+        state.frame.fetch_add(1, std::memory_order_relaxed);
+        state.frame_start = Clock::now();
+    }
+}
+
+// Closes the frame and dumps if a signal arrived or the frame was slower than the threshold.
+// Slow frames don't dump again until the previous dump has scrolled out of the window.
+inline void EndFrame() {
+    State& state = GetState();
+    if (!state.enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    std::int64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(state.frame_start - state.epoch).count();
+    std::int64_t duration_ns = NowNs() - start_ns;
+    std::uint64_t frame = state.frame.load(std::memory_order_relaxed);
+    LocalBuffer().Record(Event{"Frame", "frame", start_ns, duration_ns, frame});
+
+    bool slow = state.slow_tick_ns > 0 && duration_ns > state.slow_tick_ns
+        && (state.last_dump_frame == 0 || frame - state.last_dump_frame >= state.frames_to_keep);
+    if (slow) {
+        std::cout << "[local] Frame " << frame << " took " << duration_ns / 1000000 << " ms" << std::endl;
+    }
+
+    if (DumpRequested() || slow) {
+        DumpRequested() = 0;
+        Dump();
+    }
+}
+
+// Dumps whatever is buffered, used when the worker exits
+inline void Flush() {
+    if (Enabled()) {
+        Dump();
+    }
+}
+
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <thread>
 #include <deer.h>
 #include <hunter.h>
+#include <trace.h>
 
 // Use this to make a worker::ComponentRegistry. This worker doesn't use any components yet
 // For example use worker::Components<improbable::Position, improbable::Metadata> to track these common components
@@ -94,6 +95,10 @@ int main(int argc, char** argv) {
         std::cout << "    <deployment_id>  - name of the cloud deployment to run." << std::endl;
         std::cout << "    <login_token>   - token to use when connecting through the locator.";
         std::cout << std::endl;
+        std::cout << "Tracing options:" << std::endl;
+        std::cout << "    --trace_frames=<N>        - record the last N frames, dumped on exit or SIGUSR1." << std::endl;
+        std::cout << "    --trace_slow_tick_ms=<ms> - dump the recorded frames when a frame takes longer than <ms>." << std::endl;
+        std::cout << "    --trace_file=<path>       - file the Chrome trace-event JSON is written to." << std::endl;
     };
 
     worker::ConnectionParameters parameters;
@@ -101,13 +106,12 @@ int main(int argc, char** argv) {
     parameters.Network.ConnectionType = worker::NetworkConnectionType::kTcp;
     parameters.Network.UseExternalIp = true;
 
-    std::vector<std::string> arguments;
+    std::vector<std::string> arguments(argv + 1, argv + argc);
+    trace::ConsumeFlags(arguments, parameters.WorkerType + "_trace.json");
 
     // if no arguments are supplied, use the defaults for a local deployment
-    if (argc == 1) {
+    if (arguments.empty()) {
         arguments = { "receptionist", "localhost", "7777", parameters.WorkerType + "_" + get_random_characters(4) };
-    } else {
-        arguments = std::vector<std::string>(argv + 1, argv + argc);
     }
 
     const std::string connection_type = arguments[0];
@@ -135,12 +139,14 @@ int main(int argc, char** argv) {
     bool is_connected = connection.IsConnected();
 
     view.OnDisconnect([&](const worker::DisconnectOp& op) {
+        trace::Scope scope("OnDisconnect", "callback");
         std::cerr << "[disconnect] " << op.Reason << std::endl;
         is_connected = false;
     });
 
     // Print messages received from SpatialOS
     view.OnLogMessage([&](const worker::LogMessageOp& op) {
+        trace::Scope scope("OnLogMessage", "callback");
         if (op.Level == worker::LogLevel::kFatal) {
             std::cerr << "Fatal error: " << op.Message << std::endl;
             std::terminate();
@@ -149,14 +155,29 @@ int main(int argc, char** argv) {
     });
 
     while (is_connected) {
-        view.Process(connection.GetOpList(kGetOpListTimeoutInMilliseconds));
+        trace::BeginFrame();
+
+        trace::Scope get_op_list_scope("GetOpList");
+        auto ops = connection.GetOpList(kGetOpListTimeoutInMilliseconds);
+        get_op_list_scope.End();
+
+        trace::Scope process_scope("view.Process");
+        view.Process(ops);
+        process_scope.End();
+
+        trace::Scope entity_loop_scope("Entity loop");
         for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
             auto entity_id = it -> first;
             std::cout << "Found entity " << entity_id << std::endl;
         }
+        entity_loop_scope.End();
+
+        trace::EndFrame();
+
         std::cout << "running game loop" << std::endl;
         std::this_thread::sleep_for(std::chrono::seconds(2));
     }
 
+    trace::Flush();
     return ErrorExitStatus;
 }
@@ -0,0 +1,84 @@
+#ifndef MANAGED_AUTHORITY_TRACKER_H
+#define MANAGED_AUTHORITY_TRACKER_H
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <improbable/worker.h>
+#include <improbable/view.h>
+#include <iostream>
+#include <vector>
+#include <deer.h>
+
+// Tracks which deer this worker simulates when the simulation layer is split over a grid of
+// Managed workers, and hands deer off cleanly when their authority moves to a neighbour.
+//
+// A deer is simulated while this worker is authoritative over its deer::Health, including the
+// AuthorityLossImminent window. Damage queued for a deer is either applied by the worker that
+// holds authority when the tick runs, or its GotShot requests fail so the shooter can retry
+// against the new owner. This way damage is never applied twice or silently dropped. When a
+// loss is announced as imminent, the deer's final state is sent in the normal tick and the
+// loss is acknowledged only after that.
+class AuthorityTracker {
+    public:
+        AuthorityTracker() : gained_(0), lost_(0), imminent_(0), cpu_start_(std::clock()), last_log_(std::chrono::steady_clock::now()) {}
+
+    static bool Simulates(const worker::View& view, worker::EntityId entity_id) {
+        return view.GetAuthority<deer::Health>(entity_id) != worker::Authority::kNotAuthoritative;
+    }
+
+    //Called from the OnAuthorityChange<deer::Health> callback
+    void OnAuthorityChange(const worker::AuthorityChangeOp& op) {
+        switch (op.Authority) {
+            case worker::Authority::kAuthoritative:
+                gained_++;
+                break;
+            case worker::Authority::kAuthorityLossImminent:
+                imminent_++;
+                pending_acknowledgements_.push_back(op.EntityId);
+                break;
+            case worker::Authority::kNotAuthoritative:
+                lost_++;
+                break;
+        }
+    }
+
+    //Call after the tick has sent its updates and command responses, so deer that are about
+    //to be handed off have their final state written before the loss is acknowledged
+    void AcknowledgeImminentLosses(worker::Connection& connection, const worker::View& view) {
+        for (auto entity_id : pending_acknowledgements_) {
+            if (view.GetAuthority<deer::Health>(entity_id) == worker::Authority::kAuthorityLossImminent) {
+                connection.SendAuthorityLossImminentAcknowledgement<deer::Health>(entity_id);
+            }
+        }
+        pending_acknowledgements_.clear();
+    }
+
+    //Logs the process CPU time and the handoffs since the last call
+    void Log(std::size_t simulated_entities) {
+        auto now = std::chrono::steady_clock::now();
+        std::clock_t cpu_now = std::clock();
+        double seconds = std::chrono::duration<double>(now - last_log_).count();
+        double cpu_seconds = static_cast<double>(cpu_now - cpu_start_) / CLOCKS_PER_SEC;
+
+        std::cout << "[local] Simulating " << simulated_entities << " entities, CPU "
+                  << 100 * cpu_seconds / seconds << "%, authority gained " << gained_ << ", lost " << lost_
+                  << " (" << imminent_ << " announced), " << (gained_ + lost_) / seconds << " handoffs/s" << std::endl;
+
+        gained_ = 0;
+        lost_ = 0;
+        imminent_ = 0;
+        cpu_start_ = cpu_now;
+        last_log_ = now;
+    }
+
+    private:
+        std::vector<worker::EntityId> pending_acknowledgements_;
+        std::uint64_t gained_;
+        std::uint64_t lost_;
+        std::uint64_t imminent_;
+        std::clock_t cpu_start_;
+        std::chrono::steady_clock::time_point last_log_;
+};
+
+#endif
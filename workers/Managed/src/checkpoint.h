@@ -0,0 +1,328 @@
+#ifndef MANAGED_CHECKPOINT_H
+#define MANAGED_CHECKPOINT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <improbable/worker.h>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+// Worker-local checkpoint of the deer this worker simulates, so that a restarted worker
+// resumes their state instead of starting from nothing.
+//
+// The checkpoint is an append-only file of fixed size records. Every tick the game loop records
+// the deer whose health changed, and Commit() hands those deltas to a background thread, which
+// appends them followed by a commit marker. On resume, records after the last commit marker are
+// ignored, so a torn write never exposes half a tick. When the file has grown to several times
+// the size of the live state, the writer compacts it by writing the live state to a new file
+// and renaming that over the old one.
+//
+// The file belongs to one worker. Several writers appending to and compacting the same path
+// corrupt each other's checkpoints, so the game loop gives each worker its own path.
+//
+// GotShot requests are answered in the tick they arrive in, so the recorded health already
+// includes their damage. Requests still in flight when the worker dies can't be resumed because
+// their request IDs belong to the old connection. The shooter sees them time out.
+class Checkpoint {
+    public:
+        enum RecordKind : std::uint32_t {
+            kState = 0,
+            kRemoved = 1,
+            kCommit = 2
+        };
+
+        struct Record {
+            //The tick number for kCommit records
+            std::int64_t entity_id;
+            std::uint32_t health;
+            std::uint32_t kind;
+        };
+
+        //Compact once the file holds this many times the records needed for the live state
+        static const std::size_t kCompactionFactor = 4;
+        static const std::size_t kMinimumCompactionRecords = 4096;
+
+        //Every checkpoint file starts with these bytes
+        static const std::size_t kMagicSize = 8;
+        static const char* Magic() {
+            return "DEERCKP1";
+        }
+
+        explicit Checkpoint(const std::string& path)
+            : path_(path), file_(nullptr), tick_(0), stop_(false), live_tick_(0), file_records_(0),
+              write_ns_(0), written_records_(0), compactions_(0) {}
+
+        ~Checkpoint() {
+            if (writer_.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                }
+                ready_.notify_one();
+                writer_.join();
+            }
+            if (file_) {
+                std::fclose(file_);
+            }
+        }
+
+        Checkpoint(const Checkpoint&) = delete;
+        Checkpoint& operator=(const Checkpoint&) = delete;
+
+    //Loads the last committed state from the checkpoint file, if there is one, and starts the
+    //background writer. Returns the number of deer resumed.
+    std::size_t Resume() {
+        auto start = std::chrono::steady_clock::now();
+
+        const char* data = nullptr;
+        std::size_t size = 0;
+#ifndef _WIN32
+        void* mapping = MAP_FAILED;
+        int fd = open(path_.c_str(), O_RDONLY);
+        struct stat file_stat;
+        if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+            size = static_cast<std::size_t>(file_stat.st_size);
+            mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = mapping == MAP_FAILED ? nullptr : static_cast<const char*>(mapping);
+        }
+#else
+        std::vector<char> copy;
+        std::ifstream in(path_.c_str(), std::ios::binary);
+        if (in) {
+            copy.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            data = copy.data();
+            size = copy.size();
+        }
+#endif
+
+        if (data && size >= kMagicSize && std::memcmp(data, Magic(), kMagicSize) == 0) {
+            std::unordered_map<worker::EntityId, std::uint32_t> uncommitted;
+            std::vector<worker::EntityId> uncommitted_removals;
+            std::size_t records = (size - kMagicSize) / sizeof(Record);
+
+            for (std::size_t i = 0; i < records; i++) {
+                Record record;
+                std::memcpy(&record, data + kMagicSize + i * sizeof(Record), sizeof(Record));
+                if (record.kind == kState) {
+                    uncommitted[record.entity_id] = record.health;
+                } else if (record.kind == kRemoved) {
+                    uncommitted.erase(record.entity_id);
+                    uncommitted_removals.push_back(record.entity_id);
+                } else if (record.kind == kCommit) {
+                    for (auto entity_id : uncommitted_removals) {
+                        live_.erase(entity_id);
+                    }
+                    for (const auto& entry : uncommitted) {
+                        live_[entry.first] = entry.second;
+                    }
+                    uncommitted.clear();
+                    uncommitted_removals.clear();
+                    tick_ = record.entity_id;
+                    live_tick_ = record.entity_id;
+                }
+            }
+        } else if (data) {
+            std::cerr << "[local] Ignoring unrecognised checkpoint file " << path_ << std::endl;
+        }
+
+#ifndef _WIN32
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+
+        resumed_ = live_;
+        last_recorded_ = live_;
+
+        //Start from a compacted file, which also drops any torn tail
+        Compact();
+        writer_ = std::thread(&Checkpoint::WriterLoop, this);
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[local] Resumed " << resumed_.size() << " deer from checkpoint " << path_
+                  << " (tick " << tick_ << ") in " << ms << " ms" << std::endl;
+        return resumed_.size();
+    }
+
+    //Health to resume a deer with the first time it is simulated after a restart
+    bool TakeResumedHealth(worker::EntityId entity_id, std::uint32_t& health) {
+        auto it = resumed_.find(entity_id);
+        if (it == resumed_.end()) {
+            return false;
+        }
+        health = it -> second;
+        resumed_.erase(it);
+        return true;
+    }
+
+    //Records the health of a deer this worker simulates, only changes are written
+    void RecordHealth(worker::EntityId entity_id, std::uint32_t health) {
+        auto it = last_recorded_.find(entity_id);
+        if (it != last_recorded_.end() && it -> second == health) {
+            return;
+        }
+        last_recorded_[entity_id] = health;
+        deltas_.push_back(Record{entity_id, health, kState});
+    }
+
+    //Drops a deer whose authority moved to another worker
+    void Remove(worker::EntityId entity_id) {
+        if (last_recorded_.erase(entity_id) > 0) {
+            deltas_.push_back(Record{entity_id, 0, kRemoved});
+        }
+    }
+
+    //Hands this tick's deltas to the writer thread and logs what checkpointing costs
+    void Commit() {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t deltas = deltas_.size();
+
+        deltas_.push_back(Record{++tick_, 0, kCommit});
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            //The writer may still be busy with an earlier tick, keep the order
+            queued_.insert(queued_.end(), deltas_.begin(), deltas_.end());
+        }
+        ready_.notify_one();
+        deltas_.clear();
+
+        //The writer figures cover what it finished since the previous commit
+        double commit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "[local] Checkpoint tick " << tick_ << ": " << deltas << " deltas, "
+                  << commit_ms << " ms on the game loop, " << write_ns_.exchange(0) / 1e6 << " ms writing "
+                  << written_records_.exchange(0) << " records, " << compactions_.exchange(0) << " compactions" << std::endl;
+    }
+
+    private:
+    void WriterLoop() {
+        std::vector<Record> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+                if (queued_.empty()) {
+                    return;
+                }
+                batch.swap(queued_);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            Append(batch);
+            if (file_records_ > kMinimumCompactionRecords && file_records_ > kCompactionFactor * live_.size()) {
+                Compact();
+                compactions_++;
+            }
+            write_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            written_records_ += batch.size();
+            batch.clear();
+        }
+    }
+
+    //Writer thread only, after Resume
+    void Append(const std::vector<Record>& records) {
+        for (const auto& record : records) {
+            if (record.kind == kState) {
+                live_[record.entity_id] = record.health;
+            } else if (record.kind == kRemoved) {
+                live_.erase(record.entity_id);
+            } else if (record.kind == kCommit) {
+                live_tick_ = record.entity_id;
+            }
+        }
+
+        if (file_) {
+            std::fwrite(records.data(), sizeof(Record), records.size(), file_);
+            std::fflush(file_);
+            file_records_ += records.size();
+        }
+    }
+
+    //Rewrites the file with only the live state and reopens it for appending
+    void Compact() {
+        std::string compacted_path = path_ + ".tmp";
+        std::FILE* compacted = std::fopen(compacted_path.c_str(), "wb");
+        if (!compacted) {
+            std::cerr << "[local] Failed to write checkpoint " << compacted_path << std::endl;
+            return;
+        }
+
+        std::fwrite(Magic(), 1, kMagicSize, compacted);
+        for (const auto& entry : live_) {
+            Record record{entry.first, entry.second, kState};
+            std::fwrite(&record, sizeof(record), 1, compacted);
+        }
+        Record commit{live_tick_, 0, kCommit};
+        std::fwrite(&commit, sizeof(commit), 1, compacted);
+        std::fclose(compacted);
+
+        if (file_) {
+            std::fclose(file_);
+        }
+        //Replace the old file in one step, so a crash leaves either the old or the new checkpoint
+#ifdef _WIN32
+        if (!MoveFileExA(compacted_path.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            std::cerr << "[local] Failed to replace checkpoint " << path_ << std::endl;
+        }
+#else
+        if (std::rename(compacted_path.c_str(), path_.c_str()) != 0) {
+            std::cerr << "[local] Failed to replace checkpoint " << path_ << std::endl;
+        }
+#endif
+        file_ = std::fopen(path_.c_str(), "ab");
+        file_records_ = live_.size() + 1;
+    }
+
+        std::string path_;
+        std::FILE* file_;
+
+        //Game loop state
+        std::unordered_map<worker::EntityId, std::uint32_t> resumed_;
+        std::unordered_map<worker::EntityId, std::uint32_t> last_recorded_;
+        std::vector<Record> deltas_;
+        std::int64_t tick_;
+
+        //Shared with the writer thread
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::vector<Record> queued_;
+        bool stop_;
+        std::thread writer_;
+
+        //Writer thread state, also used by Resume before the writer starts
+        std::unordered_map<worker::EntityId, std::uint32_t> live_;
+        std::int64_t live_tick_;
+        std::size_t file_records_;
+
+        //Stats
+        std::atomic<std::int64_t> write_ns_;
+        std::atomic<std::size_t> written_records_;
+        std::atomic<std::size_t> compactions_;
+};
+
+#endif
@@ -0,0 +1,383 @@
+#ifndef MANAGED_HEALTH_KERNEL_H
+#define MANAGED_HEALTH_KERNEL_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <improbable/worker.h>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HEALTH_KERNEL_X86
+#define HEALTH_KERNEL_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HEALTH_KERNEL_X86
+#define HEALTH_KERNEL_TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Health simulation for the deer this worker simulates, run over packed arrays instead of
+// per entity through the view.
+//
+// Every deer has a slot in a set of parallel uint32 arrays: remaining health, regen and decay
+// per tick, and the damage queued for this tick. Step() advances every slot at once:
+//
+//     recovered = health > 0 ? min(regen, max - health) : 0
+//     health = health + recovered - (decay + damage), saturating at 0
+//
+// so dead deer stay dead. It keeps the regen actually applied for Recovered(), and sets a bit
+// in the changed mask for every slot whose health moved, so the game loop only sends updates
+// for those. The AVX2 or SSE4.1 path is picked at runtime from what the CPU
+// supports, with a scalar fallback for everything else.
+//
+// Slots are added and removed as this worker gains and loses authority over deer, removal
+// moves the last slot into the hole.
+class HealthKernel {
+    public:
+        enum Path {
+            kScalar = 0,
+            kSse41 = 1,
+            kAvx2 = 2
+        };
+
+        explicit HealthKernel(std::uint32_t max_health)
+            : max_health_(max_health), path_(BestPath()), step_ns_(0), stepped_entities_(0) {}
+
+    static const char* PathName(Path path) {
+        switch (path) {
+            case kAvx2:
+                return "avx2";
+            case kSse41:
+                return "sse4.1";
+            default:
+                return "scalar";
+        }
+    }
+
+    static bool Supports(Path path) {
+#if defined(HEALTH_KERNEL_X86) && defined(__GNUC__)
+        __builtin_cpu_init();
+        switch (path) {
+            case kAvx2:
+                return __builtin_cpu_supports("avx2");
+            case kSse41:
+                return __builtin_cpu_supports("sse4.1");
+            default:
+                return true;
+        }
+#elif defined(HEALTH_KERNEL_X86)
+        int info[4];
+        __cpuid(info, 1);
+        bool sse41 = (info[2] & (1 << 19)) != 0;
+        bool os_saves_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        bool avx2 = os_saves_avx && (info[1] & (1 << 5)) != 0;
+        switch (path) {
+            case kAvx2:
+                return avx2;
+            case kSse41:
+                return sse41;
+            default:
+                return true;
+        }
+#else
+        return path == kScalar;
+#endif
+    }
+
+    static Path BestPath() {
+        return Supports(kAvx2) ? kAvx2 : Supports(kSse41) ? kSse41 : kScalar;
+    }
+
+    std::size_t Size() const {
+        return entity_ids_.size();
+    }
+
+    worker::EntityId EntityId(std::size_t slot) const {
+        return entity_ids_[slot];
+    }
+
+    std::uint32_t Health(std::size_t slot) const {
+        return health_[slot];
+    }
+
+    //Regen applied to the deer in the last Step, before decay and damage
+    std::uint32_t Recovered(std::size_t slot) const {
+        return recovered_[slot];
+    }
+
+    //Adds a deer this worker now simulates, a deer that already has a slot keeps it
+    void Add(worker::EntityId entity_id, std::uint32_t health, std::uint32_t regen, std::uint32_t decay) {
+        if (slots_.count(entity_id) > 0) {
+            return;
+        }
+        slots_[entity_id] = entity_ids_.size();
+        entity_ids_.push_back(entity_id);
+        health_.push_back(std::min(health, max_health_));
+        regen_.push_back(regen);
+        decay_.push_back(decay);
+        damage_.push_back(0);
+        recovered_.push_back(0);
+        changed_.resize((entity_ids_.size() + 63) / 64);
+    }
+
+    void Remove(worker::EntityId entity_id) {
+        auto it = slots_.find(entity_id);
+        if (it == slots_.end()) {
+            return;
+        }
+
+        std::size_t slot = it -> second;
+        std::size_t last = entity_ids_.size() - 1;
+        slots_.erase(it);
+        if (slot != last) {
+            entity_ids_[slot] = entity_ids_[last];
+            health_[slot] = health_[last];
+            regen_[slot] = regen_[last];
+            decay_[slot] = decay_[last];
+            damage_[slot] = damage_[last];
+            recovered_[slot] = recovered_[last];
+            slots_[entity_ids_[slot]] = slot;
+        }
+        entity_ids_.pop_back();
+        health_.pop_back();
+        regen_.pop_back();
+        decay_.pop_back();
+        damage_.pop_back();
+        recovered_.pop_back();
+        changed_.resize((entity_ids_.size() + 63) / 64);
+    }
+
+    //Queues damage to apply in the next Step, ignored for deer without a slot
+    void AddDamage(worker::EntityId entity_id, std::uint32_t damage) {
+        auto it = slots_.find(entity_id);
+        if (it != slots_.end()) {
+            std::uint32_t& queued = damage_[it -> second];
+            queued = std::min<std::uint64_t>(std::uint64_t{queued} + damage, std::numeric_limits<std::uint32_t>::max());
+        }
+    }
+
+    //Advances every deer by one tick, clears the queued damage and rebuilds the changed mask
+    void Step() {
+        StepWith(path_);
+    }
+
+    void ClearChanged(std::size_t slot) {
+        changed_[slot / 64] &= ~(std::uint64_t{1} << (slot % 64));
+    }
+
+    void MarkChanged(std::size_t slot) {
+        changed_[slot / 64] |= std::uint64_t{1} << (slot % 64);
+    }
+
+    //Marks a deer changed in the next Step even if its health stays the same, for deer whose
+    //own deer::Health is stale, ignored if the deer has no slot by then
+    void ForceChanged(worker::EntityId entity_id) {
+        forced_.push_back(entity_id);
+    }
+
+    //Calls f(slot) for every slot whose health changed in the last Step
+    template <typename F>
+    void ForEachChanged(F f) const {
+        for (std::size_t word = 0; word < changed_.size(); word++) {
+            std::uint64_t bits = changed_[word];
+            while (bits) {
+                f(word * 64 + CountTrailingZeros(bits));
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    //Logs the path and how fast Step ran since the last call
+    void Log() {
+        std::size_t changed = 0;
+        for (auto bits : changed_) {
+            for (; bits; bits &= bits - 1) {
+                changed++;
+            }
+        }
+
+        double seconds = step_ns_ / 1e9;
+        std::cout << "[local] Health kernel (" << PathName(path_) << "): " << Size() << " deer, " << changed
+                  << " changed, " << (seconds > 0 ? stepped_entities_ / seconds : 0) << " entities/s" << std::endl;
+        step_ns_ = 0;
+        stepped_entities_ = 0;
+    }
+
+    //Steps synthetic deer through every path the CPU supports and logs entities per second.
+    //Runs on the calling thread, so the figures are per core.
+    static void Benchmark(std::size_t entities, std::size_t steps) {
+        HealthKernel kernel(100);
+        for (std::size_t i = 0; i < entities; i++) {
+            kernel.Add(static_cast<worker::EntityId>(i + 1), std::rand() % 101, 10, std::rand() % 21);
+        }
+
+        for (Path path : {kScalar, kSse41, kAvx2}) {
+            if (!Supports(path)) {
+                std::cout << "[local] Health kernel benchmark (" << PathName(path) << "): not supported by this CPU" << std::endl;
+                continue;
+            }
+
+            kernel.step_ns_ = 0;
+            kernel.stepped_entities_ = 0;
+            for (std::size_t step = 0; step < steps; step++) {
+                //Keep some damage flowing so the deer don't all settle at full health
+                for (std::size_t slot = step % 7; slot < entities; slot += 7) {
+                    kernel.damage_[slot] = 25;
+                }
+                kernel.StepWith(path);
+            }
+            std::cout << "[local] Health kernel benchmark (" << PathName(path) << "): " << entities << " deer, "
+                      << steps << " steps, " << kernel.stepped_entities_ / (kernel.step_ns_ / 1e9) << " entities/s per core" << std::endl;
+        }
+    }
+
+    private:
+    static unsigned CountTrailingZeros(std::uint64_t bits) {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctzll(bits));
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return static_cast<unsigned>(index);
+#else
+        unsigned count = 0;
+        for (; !(bits & 1); bits >>= 1) {
+            count++;
+        }
+        return count;
+#endif
+    }
+
+    void StepWith(Path path) {
+        auto start = std::chrono::steady_clock::now();
+        std::fill(changed_.begin(), changed_.end(), 0);
+
+        std::size_t done = 0;
+#ifdef HEALTH_KERNEL_X86
+        if (path == kAvx2) {
+            done = StepAvx2(health_.data(), regen_.data(), decay_.data(), damage_.data(), recovered_.data(), changed_.data(), Size(), max_health_);
+        } else if (path == kSse41) {
+            done = StepSse41(health_.data(), regen_.data(), decay_.data(), damage_.data(), recovered_.data(), changed_.data(), Size(), max_health_);
+        }
+#else
+        (void) path;
+#endif
+        //The scalar path, and the slots left over by the vector paths
+        for (std::size_t slot = done; slot < Size(); slot++) {
+            std::uint32_t health = health_[slot];
+            std::uint32_t recovered = health > 0 ? std::min(regen_[slot], max_health_ - health) : 0;
+            std::uint32_t up = health + recovered;
+            std::uint32_t loss = decay_[slot] + std::min(damage_[slot], ~decay_[slot]);
+            std::uint32_t down = up - std::min(up, loss);
+            health_[slot] = down;
+            damage_[slot] = 0;
+            recovered_[slot] = recovered;
+            if (down != health) {
+                changed_[slot / 64] |= std::uint64_t{1} << (slot % 64);
+            }
+        }
+
+        for (auto entity_id : forced_) {
+            auto it = slots_.find(entity_id);
+            if (it != slots_.end()) {
+                MarkChanged(it -> second);
+            }
+        }
+        forced_.clear();
+
+        step_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        stepped_entities_ += Size();
+    }
+
+#ifdef HEALTH_KERNEL_X86
+    //The vector paths work in blocks of 4 or 8 slots, which never straddle a 64-bit mask word,
+    //and return how many slots they stepped. Unsigned saturation is built from min, as
+    //a - min(a, b) and a + min(b, ~a). Dead lanes get their regen masked off.
+    HEALTH_KERNEL_TARGET("avx2")
+    static std::size_t StepAvx2(std::uint32_t* health, const std::uint32_t* regen, const std::uint32_t* decay, std::uint32_t* damage,
+                                std::uint32_t* recovered, std::uint64_t* changed, std::size_t count, std::uint32_t max_health) {
+        const __m256i max = _mm256_set1_epi32(static_cast<int>(max_health));
+        const __m256i ones = _mm256_set1_epi32(-1);
+        const __m256i zero = _mm256_setzero_si256();
+
+        std::size_t slot = 0;
+        for (; slot + 8 <= count; slot += 8) {
+            __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(health + slot));
+            __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(regen + slot));
+            __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(decay + slot));
+            __m256i g = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(damage + slot));
+
+            __m256i regen_applied = _mm256_andnot_si256(_mm256_cmpeq_epi32(h, zero), _mm256_min_epu32(r, _mm256_sub_epi32(max, h)));
+            __m256i up = _mm256_add_epi32(h, regen_applied);
+            __m256i loss = _mm256_add_epi32(d, _mm256_min_epu32(g, _mm256_xor_si256(d, ones)));
+            __m256i down = _mm256_sub_epi32(up, _mm256_min_epu32(up, loss));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(health + slot), down);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(damage + slot), zero);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(recovered + slot), regen_applied);
+
+            unsigned same = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(down, h))));
+            changed[slot / 64] |= static_cast<std::uint64_t>(~same & 0xFF) << (slot % 64);
+        }
+        return slot;
+    }
+
+    HEALTH_KERNEL_TARGET("sse4.1")
+    static std::size_t StepSse41(std::uint32_t* health, const std::uint32_t* regen, const std::uint32_t* decay, std::uint32_t* damage,
+                                 std::uint32_t* recovered, std::uint64_t* changed, std::size_t count, std::uint32_t max_health) {
+        const __m128i max = _mm_set1_epi32(static_cast<int>(max_health));
+        const __m128i ones = _mm_set1_epi32(-1);
+        const __m128i zero = _mm_setzero_si128();
+
+        std::size_t slot = 0;
+        for (; slot + 4 <= count; slot += 4) {
+            __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(health + slot));
+            __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(regen + slot));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(decay + slot));
+            __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(damage + slot));
+
+            __m128i regen_applied = _mm_andnot_si128(_mm_cmpeq_epi32(h, zero), _mm_min_epu32(r, _mm_sub_epi32(max, h)));
+            __m128i up = _mm_add_epi32(h, regen_applied);
+            __m128i loss = _mm_add_epi32(d, _mm_min_epu32(g, _mm_xor_si128(d, ones)));
+            __m128i down = _mm_sub_epi32(up, _mm_min_epu32(up, loss));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(health + slot), down);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(damage + slot), zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(recovered + slot), regen_applied);
+
+            unsigned same = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(down, h))));
+            changed[slot / 64] |= static_cast<std::uint64_t>(~same & 0xF) << (slot % 64);
+        }
+        return slot;
+    }
+#endif
+
+        std::uint32_t max_health_;
+        Path path_;
+
+        //Slot of every deer in the arrays below
+        std::unordered_map<worker::EntityId, std::size_t> slots_;
+        std::vector<worker::EntityId> entity_ids_;
+        std::vector<std::uint32_t> health_;
+        std::vector<std::uint32_t> regen_;
+        std::vector<std::uint32_t> decay_;
+        std::vector<std::uint32_t> damage_;
+        std::vector<std::uint32_t> recovered_;
+        //One bit per slot
+        std::vector<std::uint64_t> changed_;
+        std::vector<worker::EntityId> forced_;
+
+        //Stats
+        std::int64_t step_ns_;
+        std::uint64_t stepped_entities_;
+};
+
+#endif
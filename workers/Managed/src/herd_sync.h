@@ -0,0 +1,355 @@
+#ifndef MANAGED_HERD_SYNC_H
+#define MANAGED_HERD_SYNC_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <improbable/worker.h>
+#include <improbable/standard_library.h>
+#include <improbable/view.h>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <deer.h>
+#include <hunter.h>
+#include "authority_tracker.h"
+
+// Flags packed into deer::Herd member_flags, one byte per member
+enum HerdMemberFlags : std::uint8_t {
+    kHerdMemberShot = 1 << 0,
+    kHerdMemberRecovered = 1 << 1
+};
+
+// Counts the component updates the game loop sends and estimates their size, so per-entity
+// and herd sync can be compared on the same world. Sizes are payload estimates, not what
+// the SDK actually puts on the wire.
+class SyncStats {
+    public:
+        //Rough fixed cost of a component update: entity ID, component ID and framing
+        static const std::size_t kUpdateOverheadBytes = 16;
+
+        SyncStats() : updates_(0), bytes_(0), last_log_(std::chrono::steady_clock::now()) {}
+
+    void Count(std::size_t payload_bytes) {
+        updates_++;
+        bytes_ += kUpdateOverheadBytes + payload_bytes;
+    }
+
+    //Logs the updates and bytes sent since the last call
+    void Log(const char* mode) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - last_log_).count();
+        std::cout << "[local] Sync (" << mode << "): " << updates_ << " updates, ~" << bytes_ << " bytes, "
+                  << updates_ / seconds << " updates/s, ~" << bytes_ / seconds << " bytes/s" << std::endl;
+        updates_ = 0;
+        bytes_ = 0;
+        last_log_ = now;
+    }
+
+    private:
+        std::uint64_t updates_;
+        std::uint64_t bytes_;
+        std::chrono::steady_clock::time_point last_log_;
+};
+
+// Groups nearby deer into herd entities and syncs their state as one packed deer::Herd update
+// per herd. Deer are grouped by grid cell. A herd is split back into per-entity updates while a
+// hunter is close enough to observe it, and aggregated again once every hunter has moved away.
+//
+// With several Managed workers, a herd only carries the deer simulated by the worker that is
+// authoritative over the herd entity. Other deer in the same cell keep per-entity updates.
+// Herd entities already in the view are adopted. A missing one is only created by the worker
+// that simulates the cell's deer nearest to its centre, so neighbours don't create duplicates.
+//
+// While a deer goes out with its herd, its own deer::Health is left stale. A deer that leaves
+// its herd, because the herd split or stopped being this worker's, has to be sent on its own
+// once, see LeftHerd. A worker taking over a herded deer starts from MemberHealth, which looks
+// the deer up in an index of the members of every herd in the view, kept by OnHerdMembers.
+class HerdSync {
+    public:
+        //Edge length of the grid cell a herd covers
+        static constexpr double kCellMeters = 100;
+        //Hunters closer than this to a herd's centre observe its members individually
+        static constexpr double kSplitDistanceMeters = 200;
+        //Hunters must move further than this away before the herd is aggregated again
+        static constexpr double kAggregateDistanceMeters = 300;
+
+        using MakeHerdEntity = worker::Entity (*)(const improbable::Coordinates& centre);
+
+        HerdSync(bool enabled, MakeHerdEntity make_herd_entity) : enabled_(enabled), make_herd_entity_(make_herd_entity), herd_updates_(0) {}
+
+    bool Enabled() const {
+        return enabled_;
+    }
+
+    //Decides which herd every deer belongs to this tick and whether that herd is aggregated.
+    //Call once per tick before Record.
+    void AssignHerds(const worker::View& view) {
+        member_herds_.clear();
+        hunter_positions_.clear();
+        previous_members_.clear();
+        if (!enabled_) {
+            return;
+        }
+
+        for (auto& entry : herds_) {
+            Herd& herd = entry.second;
+            previous_members_.insert(previous_members_.end(), herd.member_ids.begin(), herd.member_ids.end());
+            herd.member_ids.clear();
+            herd.member_health.clear();
+            herd.member_flags.clear();
+            herd.nearest_member_distance = HUGE_VAL;
+            herd.nearest_member_simulated = false;
+            herd.authoritative = herd.entity_id && view.GetAuthority<deer::Herd>(*herd.entity_id) != worker::Authority::kNotAuthoritative;
+        }
+
+        for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
+            auto position = it -> second.Get<improbable::Position>();
+            if (position && it -> second.Get<hunter::Name>()) {
+                hunter_positions_.push_back(position -> coords());
+            }
+
+            //Adopt herd entities created by other workers, or by an earlier run of this one
+            if (position && it -> second.Get<deer::Herd>()) {
+                Herd& herd = FindOrAddHerd(position -> coords());
+                if (!herd.entity_id) {
+                    herd.entity_id = it -> first;
+                    herd.authoritative = view.GetAuthority<deer::Herd>(it -> first) != worker::Authority::kNotAuthoritative;
+                }
+            }
+        }
+
+        for (auto& entry : herds_) {
+            Herd& herd = entry.second;
+            double nearest = NearestHunterDistance(herd.centre);
+            if (nearest < kSplitDistanceMeters) {
+                herd.aggregated = false;
+            } else if (nearest > kAggregateDistanceMeters) {
+                herd.aggregated = true;
+            }
+        }
+
+        for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
+            auto position = it -> second.Get<improbable::Position>();
+            if (!position || !it -> second.Get<deer::Health>() || it -> second.Get<deer::Herd>()) {
+                continue;
+            }
+
+            Herd& herd = FindOrAddHerd(position -> coords());
+            double dx = position -> coords().x() - herd.centre.x();
+            double dz = position -> coords().z() - herd.centre.z();
+            double distance = std::sqrt(dx * dx + dz * dz);
+            if (distance < herd.nearest_member_distance) {
+                herd.nearest_member_distance = distance;
+                herd.nearest_member_simulated = AuthorityTracker::Simulates(view, it -> first);
+            }
+            member_herds_.emplace_back(it -> first, &herd);
+        }
+        std::sort(member_herds_.begin(), member_herds_.end(), [](const MemberHerd& a, const MemberHerd& b) {
+            return a.first < b.first;
+        });
+        std::sort(previous_members_.begin(), previous_members_.end());
+    }
+
+    //Records the state of a deer this worker simulates. Returns true if the deer is synced
+    //through its herd, in which case the caller shouldn't send per-entity updates for it.
+    bool Record(worker::EntityId entity_id, std::uint32_t health, std::uint8_t flags) {
+        auto it = std::lower_bound(member_herds_.begin(), member_herds_.end(), entity_id, [](const MemberHerd& member, worker::EntityId id) {
+            return member.first < id;
+        });
+        if (it == member_herds_.end() || it -> first != entity_id) {
+            return false;
+        }
+
+        Herd& herd = *it -> second;
+        if (!herd.aggregated || !herd.authoritative) {
+            return false;
+        }
+
+        herd.member_ids.push_back(entity_id);
+        herd.member_health.push_back(health);
+        herd.member_flags.push_back(static_cast<char>(flags));
+        return true;
+    }
+
+    //True if the deer went out with its herd last tick. Call for deer that Record didn't take
+    //this tick, their own deer::Health is stale and has to be sent.
+    bool LeftHerd(worker::EntityId entity_id) const {
+        return std::binary_search(previous_members_.begin(), previous_members_.end(), entity_id);
+    }
+
+    //The health a herd in the view last synced for a deer. Returns false if no herd holds it.
+    bool MemberHealth(worker::EntityId entity_id, std::uint32_t& health) const {
+        auto it = synced_members_.find(entity_id);
+        if (it == synced_members_.end()) {
+            return false;
+        }
+        health = it -> second.health;
+        return true;
+    }
+
+    //Called from the OnAddComponent<deer::Herd> and OnComponentUpdate<deer::Herd> callbacks with
+    //the members a herd synced. Members that are still in the herd keep their index entry.
+    void OnHerdMembers(worker::EntityId herd_id, const worker::List<worker::EntityId>& member_ids, const worker::List<std::uint32_t>& member_health) {
+        if (!enabled_) {
+            return;
+        }
+
+        herd_updates_++;
+        for (std::size_t i = 0; i < member_ids.size() && i < member_health.size(); i++) {
+            synced_members_[member_ids[i]] = SyncedMember{herd_id, member_health[i], herd_updates_};
+        }
+
+        //Drop the members that left, unless another herd has synced them since
+        auto& previous = synced_herds_[herd_id];
+        for (auto entity_id : previous) {
+            auto it = synced_members_.find(entity_id);
+            if (it != synced_members_.end() && it -> second.herd_id == herd_id && it -> second.update != herd_updates_) {
+                synced_members_.erase(it);
+            }
+        }
+        previous = member_ids;
+    }
+
+    //Called from the OnRemoveComponent<deer::Herd> callback
+    void OnHerdRemoved(worker::EntityId herd_id) {
+        auto herd = synced_herds_.find(herd_id);
+        if (herd == synced_herds_.end()) {
+            return;
+        }
+        for (auto entity_id : herd -> second) {
+            auto it = synced_members_.find(entity_id);
+            if (it != synced_members_.end() && it -> second.herd_id == herd_id) {
+                synced_members_.erase(it);
+            }
+        }
+        synced_herds_.erase(herd);
+    }
+
+    //Sends one update per herd and requests entities for herds that don't have one yet.
+    //Herds that just split send one last empty update so readers drop the stale members.
+    void Send(worker::Connection& connection, SyncStats& stats) {
+        for (auto& entry : herds_) {
+            Herd& herd = entry.second;
+            if (!herd.entity_id) {
+                if (!herd.creation_pending && herd.nearest_member_simulated) {
+                    RequestHerdEntity(connection, herd);
+                }
+                continue;
+            }
+
+            if (!herd.authoritative || (herd.member_ids.empty() && !herd.sent_members)) {
+                continue;
+            }
+
+            herd.update.set_member_ids(herd.member_ids);
+            herd.update.set_member_health(herd.member_health);
+            herd.update.set_member_flags(herd.member_flags);
+            connection.SendComponentUpdate<deer::Herd>(*herd.entity_id, herd.update);
+            stats.Count(herd.member_ids.size() * (sizeof(worker::EntityId) + sizeof(std::uint32_t) + 1));
+            herd.sent_members = !herd.member_ids.empty();
+        }
+    }
+
+    void OnCreateEntityResponse(const worker::CreateEntityResponseOp& op) {
+        for (auto& entry : herds_) {
+            Herd& herd = entry.second;
+            if (!herd.creation_pending || !(herd.creation_request == op.RequestId)) {
+                continue;
+            }
+
+            herd.creation_pending = false;
+            if (op.StatusCode == worker::StatusCode::kSuccess) {
+                herd.entity_id = *op.EntityId;
+            } else {
+                std::cerr << "[local] Failed to create herd entity: " << op.Message << std::endl;
+            }
+            return;
+        }
+    }
+
+    private:
+        using CellKey = std::pair<std::int32_t, std::int32_t>;
+
+        struct Herd {
+            explicit Herd(const improbable::Coordinates& herd_centre)
+                : centre(herd_centre), aggregated(false), authoritative(false), creation_pending(false), sent_members(false),
+                  nearest_member_distance(HUGE_VAL), nearest_member_simulated(false) {}
+
+            improbable::Coordinates centre;
+            bool aggregated;
+            worker::Option<worker::EntityId> entity_id;
+            bool authoritative;
+            bool creation_pending;
+            worker::RequestId<worker::CreateEntityRequest> creation_request;
+            bool sent_members;
+            double nearest_member_distance;
+            bool nearest_member_simulated;
+
+            //Rebuilt every tick, the capacity is kept
+            worker::List<worker::EntityId> member_ids;
+            worker::List<std::uint32_t> member_health;
+            std::string member_flags;
+            deer::Herd::Update update;
+        };
+
+        using MemberHerd = std::pair<worker::EntityId, Herd*>;
+
+        //A deer's latest health in the herds of the view, and the herd update it came from
+        struct SyncedMember {
+            worker::EntityId herd_id;
+            std::uint32_t health;
+            std::uint64_t update;
+        };
+
+    Herd& FindOrAddHerd(const improbable::Coordinates& point) {
+        CellKey key{static_cast<std::int32_t>(std::floor(point.x() / kCellMeters)),
+                    static_cast<std::int32_t>(std::floor(point.z() / kCellMeters))};
+        auto herd = herds_.find(key);
+        if (herd == herds_.end()) {
+            improbable::Coordinates centre{(key.first + 0.5) * kCellMeters, 0, (key.second + 0.5) * kCellMeters};
+            herd = herds_.insert(std::make_pair(key, Herd(centre))).first;
+            herd -> second.aggregated = NearestHunterDistance(centre) > kAggregateDistanceMeters;
+        }
+        return herd -> second;
+    }
+
+    double NearestHunterDistance(const improbable::Coordinates& point) const {
+        double nearest = HUGE_VAL;
+        for (const auto& hunter : hunter_positions_) {
+            double dx = hunter.x() - point.x();
+            double dz = hunter.z() - point.z();
+            nearest = std::min(nearest, std::sqrt(dx * dx + dz * dz));
+        }
+        return nearest;
+    }
+
+    void RequestHerdEntity(worker::Connection& connection, Herd& herd) {
+        auto result = connection.SendCreateEntityRequest(make_herd_entity_(herd.centre), {}, 500);
+        if (result) {
+            herd.creation_pending = true;
+            herd.creation_request = *result;
+        } else {
+            std::cerr << "[local] Failed to request herd entity: " << result.GetErrorMessage() << std::endl;
+        }
+    }
+
+        bool enabled_;
+        MakeHerdEntity make_herd_entity_;
+        std::map<CellKey, Herd> herds_;
+        std::vector<improbable::Coordinates> hunter_positions_;
+        //Sorted by entity ID
+        std::vector<MemberHerd> member_herds_;
+        //Deer sent through a herd last tick, sorted
+        std::vector<worker::EntityId> previous_members_;
+        //Members of the herds in the view, as last synced by them
+        std::unordered_map<worker::EntityId, SyncedMember> synced_members_;
+        std::unordered_map<worker::EntityId, worker::List<worker::EntityId>> synced_herds_;
+        std::uint64_t herd_updates_;
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef MANAGED_SHOT_BATCH_H
+#define MANAGED_SHOT_BATCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <improbable/worker.h>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <deer.h>
+#include <aggregate.h>
+#include "authority_tracker.h"
+
+using GotShot = deer::Health::Commands::GotShot;
+using GotShotRequestId = worker::RequestId<worker::IncomingCommandRequest<GotShot>>;
+
+// Queues GotShot command requests received during view.Process so they can be applied
+// in one pass during the simulation phase, instead of answering each one on the spot.
+// Buffers are cleared rather than freed between ticks, so a steady flow of commands
+// doesn't allocate.
+//
+// The logged latency is only the part spent in this worker, from the GetOpList that returned
+// a request to its response. The shooter measures the full round trip, see myWorker.
+class ShotBatch {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        ShotBatch() : ops_received_(Clock::now()) {}
+
+        struct PendingShot {
+            worker::EntityId entity_id;
+            GotShotRequestId request_id;
+            std::uint32_t damage;
+            Clock::time_point received_at;
+        };
+
+    //Call as soon as GetOpList returns, before view.Process
+    void OpsReceived() {
+        ops_received_ = Clock::now();
+    }
+
+    //Called from the OnCommandRequest callback, only records the request
+    void Enqueue(const worker::CommandRequestOp<GotShot>& op) {
+        pending_.push_back(PendingShot{op.EntityId, op.RequestId, op.Request.damage(), ops_received_});
+    }
+
+    //Sums the queued damage per entity, call once after view.Process and before DamageFor
+    void AggregateDamage() {
+        damage_by_entity_.clear();
+        for (const auto& shot : pending_) {
+            damage_by_entity_.emplace_back(shot.entity_id, shot.damage);
+        }
+        aggregate::SumByKey(damage_by_entity_, std::uint64_t{std::numeric_limits<std::uint32_t>::max()});
+    }
+
+    //Total damage queued against an entity this tick, 0 if it wasn't shot
+    std::uint32_t DamageFor(worker::EntityId entity_id) const {
+        auto it = std::lower_bound(damage_by_entity_.begin(), damage_by_entity_.end(), std::make_pair(entity_id, std::uint64_t{0}));
+        return it == damage_by_entity_.end() || it->first != entity_id ? 0 : static_cast<std::uint32_t>(it->second);
+    }
+
+    //Total damage per entity this tick, sorted by entity ID
+    const std::vector<std::pair<worker::EntityId, std::uint64_t>>& DamageByEntity() const {
+        return damage_by_entity_;
+    }
+
+    //Answers every queued request in one go, records throughput and latency, then clears
+    //the batch (keeping its capacity) for the next tick. Requests for deer this worker no
+    //longer simulates weren't applied, so they fail and the shooter can retry.
+    void SendResponses(worker::Connection& connection, const worker::View& view) {
+        if (pending_.empty()) {
+            return;
+        }
+
+        std::chrono::nanoseconds total_latency{0};
+        std::chrono::nanoseconds max_latency{0};
+
+        for (const auto& shot : pending_) {
+            if (AuthorityTracker::Simulates(view, shot.entity_id)) {
+                connection.SendCommandResponse<GotShot>(shot.request_id, GotShot::Response{});
+            } else {
+                connection.SendCommandFailure<GotShot>(shot.request_id, "Entity is not simulated by this worker");
+            }
+
+            auto latency = Clock::now() - shot.received_at;
+            total_latency += latency;
+            max_latency = std::max(max_latency, std::chrono::duration_cast<std::chrono::nanoseconds>(latency));
+        }
+
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+        std::cout << "[local] GotShot batch: " << pending_.size() << " commands over "
+                  << damage_by_entity_.size() << " entities, in-worker part of the latency avg "
+                  << Milliseconds(total_latency).count() / pending_.size() << " ms, max "
+                  << Milliseconds(max_latency).count() << " ms" << std::endl;
+
+        pending_.clear();
+        damage_by_entity_.clear();
+    }
+
+    private:
+        Clock::time_point ops_received_;
+        std::vector<PendingShot> pending_;
+        //Sorted by entity ID
+        std::vector<std::pair<worker::EntityId, std::uint64_t>> damage_by_entity_;
+};
+
+#endif
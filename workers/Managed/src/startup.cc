@@ -1,19 +1,29 @@
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <improbable/worker.h>
 #include <improbable/standard_library.h>
 #include <improbable/view.h>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <deer.h>
 #include <hunter.h>
+#include <trace.h>
+#include <allocation_counter.h>
+#include "authority_tracker.h"
+#include "checkpoint.h"
+#include "health_kernel.h"
+#include "herd_sync.h"
+#include "shot_batch.h"
 
 // Use this to make a worker::ComponentRegistry.
 // For example use worker::Components<improbable::Position, improbable::Metadata> to track these common components
 using ComponentRegistry = worker::Components<
     deer::Health, 
     deer::Dialogue,
+    deer::Herd,
     hunter::Health, 
     hunter::Name, 
     improbable::Position, 
@@ -26,6 +36,26 @@ using ComponentRegistry = worker::Components<
 const int ErrorExitStatus = 1;
 const std::string kLoggerName = "startup.cc";
 const std::uint32_t kGetOpListTimeoutInMilliseconds = 100;
+const std::uint32_t kDeerMaxHealth = 100;
+const std::uint32_t kDeerRegenPerTick = 10;
+const std::uint32_t kDeerMaxDecayPerTick = 20;
+//Test deer are spread over the world of the launch configurations, 1500m x 1500m around the origin
+const double kWorldEdgeMeters = 1500;
+const std::uint32_t kDefaultTestDeer = 1000;
+//Snapshot entity whose Position only the simulation layer writes, so exactly one Managed
+//worker is authoritative over it
+const worker::EntityId kSpawnerEntityId = 1;
+
+//Decay per tick of a deer, between 0 and kDeerMaxDecayPerTick. It only depends on the entity ID,
+//so a deer keeps its rate when another worker takes it over or its worker restarts.
+std::uint32_t DeerDecayPerTick(worker::EntityId entity_id) {
+    //splitmix64 finaliser, so consecutive IDs don't get consecutive rates
+    std::uint64_t x = static_cast<std::uint64_t>(entity_id);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+    return static_cast<std::uint32_t>(x % (kDeerMaxDecayPerTick + 1));
+}
 
 worker::Connection ConnectWithReceptionist(const std::string hostname,
                                            const std::uint16_t port,
@@ -127,7 +157,8 @@ void AddDeerEntityAcl(worker::Entity& entity, worker::List<WorkerAttribute> read
         {improbable::Position::ComponentId, writer_requirement_set},
         {improbable::EntityAcl::ComponentId, writer_requirement_set},
         {deer::Health::ComponentId, writer_requirement_set},
-        {deer::Dialogue::ComponentId, writer_requirement_set}
+        {deer::Dialogue::ComponentId, writer_requirement_set},
+        {deer::Herd::ComponentId, writer_requirement_set}
     };
 
     //Add to the EntityACl component, Read access for the reader requirement set and write access for writer requirement set
@@ -195,6 +226,7 @@ void CreateHunterEntity(worker::Connection& connection, worker::View& view, Hunt
     //Next, we create an entity with the reserved ID.
     //This registers a function as the callback when entity ID reservation is successful
     view.OnReserveEntityIdsResponse([entity_id_reservation_request_id, &connection, &entity_creation_request_id, hunter, readers, writer](const worker::ReserveEntityIdsResponseOp& op){
+        trace::Scope scope("OnReserveEntityIdsResponse", "callback");
         if (op.RequestId == entity_id_reservation_request_id && op.StatusCode == worker::StatusCode::kSuccess) {
             worker::Entity entity;
             entity.Add<improbable::Position>({{1, 2, 3}});
@@ -216,6 +248,18 @@ void CreateHunterEntity(worker::Connection& connection, worker::View& view, Hunt
     });
 }
 
+//Herd entities are written by the simulation layer, like the deer they stand in for
+worker::Entity MakeHerdEntity(const improbable::Coordinates& centre) {
+    worker::Entity entity;
+    entity.Add<improbable::Position>({centre});
+    entity.Add<deer::Herd>({{}, {}, ""});
+    AddDeerEntityAcl(entity,
+        worker::List<WorkerAttribute> {WorkerAttribute::simulation, WorkerAttribute::AI, WorkerAttribute::client},
+        WorkerAttribute::simulation
+    );
+    return entity;
+}
+
 void AddDeerInterestSphere(worker::Entity& entity) {
     std::cout << "Adding entity sphere interest..." << std::endl;
 
@@ -265,29 +309,35 @@ void AddDeerInterestSphere(worker::Entity& entity) {
     std::cout << "Entity sphere interest added!" << std::endl;
 }
 
-void CreateDeerEntity(worker::Connection& connection, worker::View& view, uint32_t health, worker::List<WorkerAttribute> readers, WorkerAttribute writer) {
-    //Entity Creation
-    worker::RequestId<worker::CreateEntityRequest> entity_creation_request_id;
+//Reserves IDs for count deer in one request and creates them at random positions across the
+//world, so every worker of a sharded simulation layer gets a share of them
+void CreateDeerPopulation(worker::Connection& connection, worker::View& view, std::uint32_t count, uint32_t health, worker::List<WorkerAttribute> readers, WorkerAttribute writer) {
+    worker::RequestId<worker::ReserveEntityIdsRequest> entity_id_reservation_request_id = connection.SendReserveEntityIdsRequest(count, 500);
 
-    //First, reserve 1 Entity ID (timeout 500 ms)
-    worker::RequestId<worker::ReserveEntityIdsRequest> entity_id_reservation_request_id = connection.SendReserveEntityIdsRequest(1, 500);
+    view.OnReserveEntityIdsResponse([entity_id_reservation_request_id, &connection, health, readers, writer](const worker::ReserveEntityIdsResponseOp& op){
+        trace::Scope scope("OnReserveEntityIdsResponse", "callback");
+        if (!(op.RequestId == entity_id_reservation_request_id)) {
+            return;
+        }
+        if (op.StatusCode != worker::StatusCode::kSuccess) {
+            std::cerr << "[local] Failed to reserve test deer IDs: " << op.Message << std::endl;
+            return;
+        }
+
+        std::cout << "[local] Creating " << op.NumberOfEntityIds << " test deer" << std::endl;
+        for (std::size_t i = 0; i < op.NumberOfEntityIds; i++) {
+            double x = (std::rand() / (RAND_MAX + 1.0) - 0.5) * kWorldEdgeMeters;
+            double z = (std::rand() / (RAND_MAX + 1.0) - 0.5) * kWorldEdgeMeters;
 
-    //Next, we create an entity with the reserved ID.
-    //This registers a function as the callback when entity ID reservation is successful
-    view.OnReserveEntityIdsResponse([entity_id_reservation_request_id, &connection, &entity_creation_request_id, health, readers, writer](const worker::ReserveEntityIdsResponseOp& op){
-        if (op.RequestId == entity_id_reservation_request_id && op.StatusCode == worker::StatusCode::kSuccess) {
             worker::Entity entity;
-            entity.Add<improbable::Position>({{1, 2, 3}});
+            entity.Add<improbable::Position>({{x, 0, z}});
             entity.Add<deer::Health>({health});
             entity.Add<deer::Dialogue>({"bambi"});
             AddDeerEntityAcl(entity, readers, writer);
             AddDeerInterestSphere(entity);
 
-            auto result = connection.SendCreateEntityRequest(entity, op.FirstEntityId, 500);
-            if (result) {
-                connection.SendLogMessage(worker::LogLevel::kDebug, "Creating Entity", "Successfully created entity");
-                entity_creation_request_id = *result;
-            } else {
+            auto result = connection.SendCreateEntityRequest(entity, worker::Option<worker::EntityId>{*op.FirstEntityId + static_cast<worker::EntityId>(i)}, 500);
+            if (!result) {
                 connection.SendLogMessage(worker::LogLevel::kError, "Creating Entity", result.GetErrorMessage());
                 std::cout << "[local] Failed to create entity: " << result.GetErrorMessage() << std::endl;
                 std::terminate();
@@ -296,19 +346,24 @@ void CreateDeerEntity(worker::Connection& connection, worker::View& view, uint32
     });
 }
 
-void TriggerDeerHealthEvent(worker::Connection& connection, worker::EntityId entity_id, uint32_t recovered_health) {    
-    deer::Health::Update update;
-    deer::Recovered event{recovered_health};
-
-    update.add_recovered(event);
+//The Trigger* helpers reuse the caller's update so the game loop doesn't allocate per entity.
+//The event is sent along with whatever fields are already set on the update.
+void TriggerDeerHealthEvent(worker::Connection& connection, worker::EntityId entity_id, deer::Health::Update& update, uint32_t recovered_health) {
+    //Only deer that actually regained health report a recovered event
+    update.recovered().clear();
+    if (recovered_health > 0) {
+        update.add_recovered(deer::Recovered{recovered_health});
+    }
     connection.SendComponentUpdate<deer::Health>(entity_id, update);
 }
 
-void TriggerDeerDialogueEvent(worker::Connection& connection, worker::EntityId entity_id, std::string message) {    
-    deer::Dialogue::Update update;
-    deer::SaidSomething event{message};
-
-    update.add_said_something(event);
+void TriggerDeerDialogueEvent(worker::Connection& connection, worker::EntityId entity_id, deer::Dialogue::Update& update, const std::string& message) {
+    auto& events = update.said_something();
+    if (events.empty()) {
+        update.add_said_something(deer::SaidSomething{message});
+    } else {
+        events.front().set_message(message);
+    }
     connection.SendComponentUpdate<deer::Dialogue>(entity_id, update);
 }
 
@@ -329,15 +384,61 @@ int main(int argc, char** argv) {
         std::cout << std::endl;
         std::cout << "    <worker_id>     - (optional) name of the worker assigned by SpatialOS." << std::endl;
         std::cout << std::endl;
+        std::cout << "Tracing options:" << std::endl;
+        std::cout << "    --trace_frames=<N>        - record the last N frames, dumped on exit or SIGUSR1." << std::endl;
+        std::cout << "    --trace_slow_tick_ms=<ms> - dump the recorded frames when a frame takes longer than <ms>." << std::endl;
+        std::cout << "    --trace_file=<path>       - file the Chrome trace-event JSON is written to." << std::endl;
+        std::cout << "Sync options:" << std::endl;
+        std::cout << "    --herd_sync               - sync unobserved deer through packed deer::Herd updates." << std::endl;
+        std::cout << "Checkpoint options:" << std::endl;
+        std::cout << "    --checkpoint_file=<path>  - checkpoint simulated deer to <path>.<worker_id> and resume from it on restart." << std::endl;
+        std::cout << "                                Needs <worker_id>, a generated ID never matches a previous run." << std::endl;
+        std::cout << "Test entity options:" << std::endl;
+        std::cout << "    --test_deer=<N>           - number of deer to spread over the world, " << kDefaultTestDeer << " by default." << std::endl;
+        std::cout << "Benchmark options:" << std::endl;
+        std::cout << "    --benchmark_health_kernel=<N> - step N synthetic deer through every health kernel path and exit." << std::endl;
+    };
+
+    std::vector<std::string> arguments(argv + 1, argv + argc);
+    trace::ConsumeFlags(arguments, "Managed_trace.json");
+
+    auto herd_sync_flag = std::find(arguments.begin(), arguments.end(), "--herd_sync");
+    const bool use_herd_sync = herd_sync_flag != arguments.end();
+    if (use_herd_sync) {
+        arguments.erase(herd_sync_flag);
+    }
+
+    //Removes a --name=<value> flag from the arguments, returns false if it wasn't given
+    auto take_flag_value = [&arguments](const std::string& flag, std::string& value) -> bool {
+        auto argument = std::find_if(arguments.begin(), arguments.end(), [&flag](const std::string& candidate) {
+            return candidate.compare(0, flag.size(), flag) == 0;
+        });
+        if (argument == arguments.end()) {
+            return false;
+        }
+        value = argument -> substr(flag.size());
+        arguments.erase(argument);
+        return true;
     };
 
-    std::vector<std::string> arguments;
+    std::string checkpoint_file;
+    take_flag_value("--checkpoint_file=", checkpoint_file);
+
+    std::string test_deer_value;
+    std::uint32_t test_deer = kDefaultTestDeer;
+    if (take_flag_value("--test_deer=", test_deer_value)) {
+        test_deer = static_cast<std::uint32_t>(std::strtoul(test_deer_value.c_str(), nullptr, 10));
+    }
+
+    std::string benchmark_deer;
+    if (take_flag_value("--benchmark_health_kernel=", benchmark_deer)) {
+        HealthKernel::Benchmark(std::strtoul(benchmark_deer.c_str(), nullptr, 10), 100);
+        return 0;
+    }
 
     // if no arguments are supplied, use the defaults for a local deployment
-    if (argc == 1) {
+    if (arguments.empty()) {
         arguments = { "receptionist", "localhost", "7777" };
-    } else {
-        arguments = std::vector<std::string>(argv + 1, argv + argc);
     }
 
     if (arguments.size() != 4 && arguments.size() != 3) {
@@ -360,6 +461,13 @@ int main(int argc, char** argv) {
         workerId = parameters.WorkerType + "_" + get_random_characters(4);
     }
 
+    //The checkpoint is found again by the worker ID, a random one would never be resumed
+    if (!checkpoint_file.empty() && arguments.size() != 4) {
+        std::cerr << "[local] --checkpoint_file needs the <worker_id> argument, so a restarted worker finds its checkpoint" << std::endl;
+        print_usage();
+        return ErrorExitStatus;
+    }
+
     std::cout << "[local] Connecting to SpatialOS as " << workerId << "..." << std::endl;
 
     // Connect with receptionist
@@ -372,12 +480,14 @@ int main(int argc, char** argv) {
     bool is_connected = connection.IsConnected();
 
     view.OnDisconnect([&](const worker::DisconnectOp& op) {
+        trace::Scope scope("OnDisconnect", "callback");
         std::cerr << "[disconnect] " << op.Reason << std::endl;
         is_connected = false;
     });
 
     // Print log messages received from SpatialOS
     view.OnLogMessage([&](const worker::LogMessageOp& op) {
+        trace::Scope scope("OnLogMessage", "callback");
         if (op.Level == worker::LogLevel::kFatal) {
             std::cerr << "Fatal error: " << op.Message << std::endl;
             std::terminate();
@@ -388,80 +498,262 @@ int main(int argc, char** argv) {
     //Doesn't work
     view.OnComponentUpdate<hunter::Name>(
         [](const worker::ComponentUpdateOp<hunter::Name>& op) {
+            trace::Scope scope("OnComponentUpdate<hunter::Name>", "callback");
             for (auto it : op.Update.first_name()) {
                 std::cout << "Hunter first name change: " << it << std::endl;
             }
         }
     );
 
-    view.OnCommandRequest<deer::Health::Commands::GotShot>(
-        [&connection](const worker::CommandRequestOp<deer::Health::Commands::GotShot>& op) {
-            std::cout << "Command received to take " << op.Request.damage() << " damage" << std::endl;
+    //GotShot requests are only queued here, damage is applied and responses are sent
+    //once per tick in the game loop
+    ShotBatch shot_batch;
 
-            connection.SendCommandResponse<deer::Health::Commands::GotShot>(
-                worker::RequestId<worker::IncomingCommandRequest<deer::Health::Commands::GotShot>> {op.RequestId}, 
-                deer::Health::Commands::GotShot::Response {}
-            );
+    view.OnCommandRequest<deer::Health::Commands::GotShot>(
+        [&shot_batch](const worker::CommandRequestOp<deer::Health::Commands::GotShot>& op) {
+            trace::Scope scope("OnCommandRequest<deer::Health::Commands::GotShot>", "callback");
+            shot_batch.Enqueue(op);
         }
     );
 
+    //With the simulation layer split over several workers, only deer this worker is
+    //authoritative over are simulated
+    AuthorityTracker authority_tracker;
+
+    //Simulated deer are checkpointed when --checkpoint_file is set. Workers of a sharded layer
+    //share their arguments, so each one writes its own file named after its worker ID.
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (!checkpoint_file.empty()) {
+        checkpoint.reset(new Checkpoint(checkpoint_file + "." + workerId));
+    }
+
+    //Groups of unobserved deer are synced as one deer::Herd update when --herd_sync is set
+    HerdSync herd_sync(use_herd_sync, MakeHerdEntity);
+    SyncStats sync_stats;
+
+    //Keeps the index of herd members that a worker taking over a herded deer seeds its health from
+    view.OnAddComponent<deer::Herd>([&herd_sync](const worker::AddComponentOp<deer::Herd>& op) {
+        trace::Scope scope("OnAddComponent<deer::Herd>", "callback");
+        herd_sync.OnHerdMembers(op.EntityId, op.Data.member_ids(), op.Data.member_health());
+    });
+
+    view.OnComponentUpdate<deer::Herd>([&herd_sync](const worker::ComponentUpdateOp<deer::Herd>& op) {
+        trace::Scope scope("OnComponentUpdate<deer::Herd>", "callback");
+        if (op.Update.member_ids() && op.Update.member_health()) {
+            herd_sync.OnHerdMembers(op.EntityId, *op.Update.member_ids(), *op.Update.member_health());
+        }
+    });
+
+    view.OnRemoveComponent<deer::Herd>([&herd_sync](const worker::RemoveComponentOp& op) {
+        trace::Scope scope("OnRemoveComponent<deer::Herd>", "callback");
+        herd_sync.OnHerdRemoved(op.EntityId);
+    });
+
+    //Health of the simulated deer, stepped over packed arrays once per tick
+    HealthKernel health_kernel(kDeerMaxHealth);
+
+    view.OnAuthorityChange<deer::Health>([&authority_tracker, &checkpoint, &health_kernel, &herd_sync, &view](const worker::AuthorityChangeOp& op) {
+        trace::Scope scope("OnAuthorityChange<deer::Health>", "callback");
+        authority_tracker.OnAuthorityChange(op);
+
+        if (op.Authority == worker::Authority::kAuthoritative) {
+            //Carry on from the checkpointed health after a restart, otherwise from the last update.
+            //A herded deer's own deer::Health is stale, its herd has the latest health.
+            uint32_t health = kDeerMaxHealth;
+            bool resumed = checkpoint && checkpoint -> TakeResumedHealth(op.EntityId, health);
+            bool herded = !resumed && herd_sync.Enabled() && herd_sync.MemberHealth(op.EntityId, health);
+            if (!resumed && !herded) {
+                auto entity = view.Entities.find(op.EntityId);
+                if (entity != view.Entities.end()) {
+                    auto data = entity -> second.Get<deer::Health>();
+                    if (data) {
+                        health = std::min(data -> remaining_health(), kDeerMaxHealth);
+                    }
+                }
+            }
+            health_kernel.Add(op.EntityId, health, kDeerRegenPerTick, DeerDecayPerTick(op.EntityId));
+            if (checkpoint) {
+                checkpoint -> RecordHealth(op.EntityId, health);
+            }
+            //Send it once even if its health doesn't move, observers may only have the herd's copy
+            health_kernel.ForceChanged(op.EntityId);
+        } else if (op.Authority == worker::Authority::kNotAuthoritative) {
+            health_kernel.Remove(op.EntityId);
+            if (checkpoint) {
+                checkpoint -> Remove(op.EntityId);
+            }
+        }
+    });
+
+    view.OnCreateEntityResponse([&herd_sync](const worker::CreateEntityResponseOp& op) {
+        trace::Scope scope("OnCreateEntityResponse", "callback");
+        herd_sync.OnCreateEntityResponse(op);
+    });
+
     if (is_connected) {
         std::cout << "[local] Connected successfully to SpatialOS, listening to ops... " << std::endl;
     }
 
-    //Create entity test object
-    //For some reason, myWorker has 'simulation' attribute in inspector instead of 'AI' attribute
-    CreateDeerEntity(connection, view, 100,
-        worker::List<WorkerAttribute> {WorkerAttribute::simulation, WorkerAttribute::AI, WorkerAttribute::client}, 
-        WorkerAttribute::simulation
-    );
+    if (checkpoint) {
+        checkpoint -> Resume();
+    }
 
-    CreateHunterEntity(connection, view, Hunter(444, "Joshie", "Hunter"), 
-        worker::List<WorkerAttribute> {WorkerAttribute::simulation, WorkerAttribute::AI, WorkerAttribute::client},
-        WorkerAttribute::AI
-    );
+    //Only the worker that holds the spawner entity creates the test objects, once the loop is running.
+    //It first asks SpatialOS for the deer that already exist, so a restarted or newly assigned
+    //spawner doesn't create a second population.
+    bool query_test_entities = false;
+    bool create_test_entities = false;
+    bool test_entities_created = false;
+    worker::RequestId<worker::EntityQueryRequest> test_entities_query_id{0};
+
+    view.OnAuthorityChange<improbable::Position>([&query_test_entities, &test_entities_created](const worker::AuthorityChangeOp& op) {
+        trace::Scope scope("OnAuthorityChange<improbable::Position>", "callback");
+        if (op.EntityId == kSpawnerEntityId && op.Authority == worker::Authority::kAuthoritative && !test_entities_created) {
+            query_test_entities = true;
+        }
+    });
 
-    //Update variables 
-    deer::Health::Update deer_health_update;
+    view.OnEntityQueryResponse([&query_test_entities, &create_test_entities, &test_entities_created, &test_entities_query_id](const worker::EntityQueryResponseOp& op) {
+        trace::Scope scope("OnEntityQueryResponse", "callback");
+        if (!(op.RequestId == test_entities_query_id) || test_entities_created) {
+            return;
+        }
+        if (op.StatusCode != worker::StatusCode::kSuccess) {
+            std::cerr << "[local] Failed to query existing deer, retrying: " << op.Message << std::endl;
+            query_test_entities = true;
+            return;
+        }
+        test_entities_created = true;
+        if (op.ResultCount == 0) {
+            create_test_entities = true;
+        } else {
+            std::cout << "[local] Found " << op.ResultCount << " existing deer, not creating the test entities" << std::endl;
+        }
+    });
 
-    //Random number between lower and upper bounds, inclusive
-    auto random_health = [](int lower, int upper) {
-        return rand()%(upper - lower + 1) + lower;
-    };
+    //Update variables, reused every tick
+    deer::Health::Update deer_health_update;
+    deer::Dialogue::Update deer_dialogue_update;
+    std::string dialogue_message;
+    char dialogue_buffer[64];
+    allocation_counter::TickCheck allocation_check;
 
     std::cout << "[local] Starting game loopie!" << std::endl;
     
     //This is the game loop :)
     while (is_connected) {
+        trace::BeginFrame();
+
         //dispatcher.Process(connection.GetOpList(kGetOpListTimeoutInMilliseconds));
         //The ops list is so the connection doesn't time out
+        trace::Scope get_op_list_scope("GetOpList");
         auto ops = connection.GetOpList(kGetOpListTimeoutInMilliseconds);
+        shot_batch.OpsReceived();
+        get_op_list_scope.End();
 
         //Process ops so entities and components get added automatically
+        trace::Scope process_scope("view.Process");
         view.Process(ops);
+        process_scope.End();
+
+        if (query_test_entities) {
+            query_test_entities = false;
+            const worker::query::EntityQuery existing_deer{
+                worker::query::ComponentConstraint{deer::Health::ComponentId},
+                worker::query::CountResultType{}
+            };
+            test_entities_query_id = connection.SendEntityQueryRequest(existing_deer, {});
+        }
 
-        //Now let's iterate over all entities and update their components
-        for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
-            auto entity_id = it -> first;
+        //Create entity test objects
+        //For some reason, myWorker has 'simulation' attribute in inspector instead of 'AI' attribute
+        if (create_test_entities) {
+            create_test_entities = false;
+            CreateDeerPopulation(connection, view, test_deer, kDeerMaxHealth,
+                worker::List<WorkerAttribute> {WorkerAttribute::simulation, WorkerAttribute::AI, WorkerAttribute::client}, 
+                WorkerAttribute::simulation
+            );
 
-            uint32_t current_health = random_health(0, 100);
+            CreateHunterEntity(connection, view, Hunter(444, "Joshie", "Hunter"), 
+                worker::List<WorkerAttribute> {WorkerAttribute::simulation, WorkerAttribute::AI, WorkerAttribute::client},
+                WorkerAttribute::AI
+            );
+        }
 
-            //Make random values:
-            deer_health_update.set_remaining_health(current_health);
+        allocation_check.Begin();
+        shot_batch.AggregateDamage();
+        herd_sync.AssignHerds(view);
 
-            //Send updates to SpatialOS!
-            connection.SendComponentUpdate<deer::Health>(entity_id, deer_health_update);
+        //Regen, decay and this tick's damage are applied to every simulated deer at once
+        trace::Scope health_kernel_scope("Health kernel");
+        for (const auto& shot : shot_batch.DamageByEntity()) {
+            health_kernel.AddDamage(shot.first, static_cast<uint32_t>(shot.second));
+        }
+        health_kernel.Step();
+        health_kernel_scope.End();
+
+        //Only deer whose health changed are checkpointed and sent
+        trace::Scope entity_loop_scope("Entity loop");
+        if (checkpoint) {
+            health_kernel.ForEachChanged([&](std::size_t slot) {
+                checkpoint -> RecordHealth(health_kernel.EntityId(slot), health_kernel.Health(slot));
+            });
+        }
 
-            //Send an event to be received by other workers
-            std::string message = "Deer # " + std::to_string(entity_id) + "says its health is " + std::to_string(current_health);
-            TriggerDeerHealthEvent(connection, entity_id, 10);
-            TriggerDeerDialogueEvent(connection, entity_id, message);
+        //Unobserved deer go out with their herd instead, and nobody is near enough to hear them
+        if (herd_sync.Enabled()) {
+            for (std::size_t slot = 0; slot < health_kernel.Size(); slot++) {
+                auto entity_id = health_kernel.EntityId(slot);
+                std::uint8_t herd_flags = (health_kernel.Recovered(slot) > 0 ? kHerdMemberRecovered : 0) |
+                                          (shot_batch.DamageFor(entity_id) > 0 ? kHerdMemberShot : 0);
+                if (herd_sync.Record(entity_id, health_kernel.Health(slot), herd_flags)) {
+                    health_kernel.ClearChanged(slot);
+                } else if (herd_sync.LeftHerd(entity_id)) {
+                    health_kernel.MarkChanged(slot);
+                }
+            }
         }
 
+        health_kernel.ForEachChanged([&](std::size_t slot) {
+            auto entity_id = health_kernel.EntityId(slot);
+            uint32_t current_health = health_kernel.Health(slot);
+            deer_health_update.set_remaining_health(current_health);
+
+            //Send updates to SpatialOS, along with an event to be received by other workers
+            TriggerDeerHealthEvent(connection, entity_id, deer_health_update, health_kernel.Recovered(slot));
+            sync_stats.Count(2 * sizeof(uint32_t));
+
+            std::snprintf(dialogue_buffer, sizeof(dialogue_buffer), "Deer # %lld says its health is %u",
+                          static_cast<long long>(entity_id), static_cast<unsigned>(current_health));
+            dialogue_message.assign(dialogue_buffer);
+            TriggerDeerDialogueEvent(connection, entity_id, deer_dialogue_update, dialogue_message);
+            sync_stats.Count(dialogue_message.size());
+        });
+        herd_sync.Send(connection, sync_stats);
+        entity_loop_scope.End();
+
+        //Answer all GotShot requests queued during view.Process in one batch
+        trace::Scope send_scope("Send GotShot responses");
+        shot_batch.SendResponses(connection, view);
+        authority_tracker.AcknowledgeImminentLosses(connection, view);
+        send_scope.End();
+
+        if (checkpoint) {
+            trace::Scope checkpoint_scope("Checkpoint commit");
+            checkpoint -> Commit();
+        }
+
+        allocation_check.End(view.Entities.size());
+        sync_stats.Log(herd_sync.Enabled() ? "herd" : "per-entity");
+        health_kernel.Log();
+        authority_tracker.Log(health_kernel.Size());
+        trace::EndFrame();
+
         //Now go to sleep for a bit to avoid excess changes
         std::this_thread::sleep_for(std::chrono::seconds(5));
     }
 
+    trace::Flush();
     return ErrorExitStatus;
 }
 
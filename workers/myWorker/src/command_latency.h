@@ -0,0 +1,89 @@
+#ifndef MYWORKER_COMMAND_LATENCY_H
+#define MYWORKER_COMMAND_LATENCY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <improbable/worker.h>
+#include <iostream>
+#include <vector>
+
+// Measures the round trip of the command requests this worker sends, from SendCommandRequest
+// to the GetOpList that hands back the response. This is the latency a shooter actually sees,
+// including the time the request and the response spend queued on both workers.
+//
+// Request IDs grow with every request on a connection, so pending requests are kept in a
+// sorted vector. Answered entries are dropped once per tick, which keeps the capacity.
+class CommandLatency {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        explicit CommandLatency(const char* command)
+            : command_(command), responses_(0), failures_(0), timeouts_(0), total_latency_(0), max_latency_(0) {}
+
+    void Sent(std::uint64_t request_id) {
+        pending_.push_back(Pending{request_id, Clock::now(), false});
+    }
+
+    //Called from the OnCommandResponse callback
+    void Received(std::uint64_t request_id, worker::StatusCode status_code) {
+        auto it = std::lower_bound(pending_.begin(), pending_.end(), request_id, [](const Pending& pending, std::uint64_t id) {
+            return pending.request_id < id;
+        });
+        if (it == pending_.end() || it -> request_id != request_id || it -> answered) {
+            return;
+        }
+        it -> answered = true;
+
+        if (status_code == worker::StatusCode::kTimeout) {
+            timeouts_++;
+            return;
+        }
+        if (status_code != worker::StatusCode::kSuccess) {
+            failures_++;
+            return;
+        }
+
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - it -> sent_at);
+        responses_++;
+        total_latency_ += latency;
+        max_latency_ = std::max(max_latency_, latency);
+    }
+
+    //Logs the round trips completed since the last call and drops the answered requests
+    void Log() {
+        pending_.erase(std::remove_if(pending_.begin(), pending_.end(), [](const Pending& pending) {
+            return pending.answered;
+        }), pending_.end());
+
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+        std::cout << "[local] " << command_ << " round trip: " << responses_ << " responses, avg "
+                  << (responses_ > 0 ? Milliseconds(total_latency_).count() / responses_ : 0) << " ms, max "
+                  << Milliseconds(max_latency_).count() << " ms, " << failures_ << " failed, "
+                  << timeouts_ << " timed out, " << pending_.size() << " outstanding" << std::endl;
+
+        responses_ = 0;
+        failures_ = 0;
+        timeouts_ = 0;
+        total_latency_ = std::chrono::nanoseconds{0};
+        max_latency_ = std::chrono::nanoseconds{0};
+    }
+
+    private:
+        struct Pending {
+            std::uint64_t request_id;
+            Clock::time_point sent_at;
+            bool answered;
+        };
+
+        const char* command_;
+        //Sorted by request ID
+        std::vector<Pending> pending_;
+        std::uint64_t responses_;
+        std::uint64_t failures_;
+        std::uint64_t timeouts_;
+        std::chrono::nanoseconds total_latency_;
+        std::chrono::nanoseconds max_latency_;
+};
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef MYWORKER_EVENT_PIPELINE_H
+#define MYWORKER_EVENT_PIPELINE_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <improbable/worker.h>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <deer.h>
+
+enum DeerEventType : std::uint8_t {
+    kSaidSomething = 0,
+    kRecovered = 1
+};
+
+// The events received during one tick, stored column by column. Row i is one event: the deer
+// it came from, its type and its payload. For kRecovered the payload is the amount, for
+// kSaidSomething it's the message, stored in one shared character buffer.
+class EventBatch {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+    std::size_t Size() const {
+        return entity_ids_.size();
+    }
+
+    worker::EntityId EntityId(std::size_t i) const {
+        return entity_ids_[i];
+    }
+
+    DeerEventType Type(std::size_t i) const {
+        return types_[i];
+    }
+
+    std::uint32_t Amount(std::size_t i) const {
+        return payloads_[i];
+    }
+
+    const char* MessageData(std::size_t i) const {
+        return message_bytes_.data() + payloads_[i];
+    }
+
+    std::size_t MessageSize(std::size_t i) const {
+        return message_sizes_[i];
+    }
+
+    Clock::time_point ReceivedAt(std::size_t i) const {
+        return received_at_[i];
+    }
+
+    private:
+        friend class EventPipeline;
+
+    void Append(worker::EntityId entity_id, DeerEventType type, std::uint32_t payload, std::uint32_t message_size, Clock::time_point received_at) {
+        entity_ids_.push_back(entity_id);
+        types_.push_back(type);
+        payloads_.push_back(payload);
+        message_sizes_.push_back(message_size);
+        received_at_.push_back(received_at);
+    }
+
+    //Keeps the capacity for the next tick
+    void Clear() {
+        entity_ids_.clear();
+        types_.clear();
+        payloads_.clear();
+        message_sizes_.clear();
+        received_at_.clear();
+        message_bytes_.clear();
+    }
+
+        std::vector<worker::EntityId> entity_ids_;
+        std::vector<DeerEventType> types_;
+        std::vector<std::uint32_t> payloads_;
+        std::vector<std::uint32_t> message_sizes_;
+        std::vector<Clock::time_point> received_at_;
+        std::string message_bytes_;
+};
+
+// Collects deer::Dialogue and deer::Health events received during view.Process into an
+// EventBatch, then hands the whole batch to every consumer in one pass once processing is done.
+// The OnComponentUpdate callbacks only append to the batch.
+//
+// Every tick it logs the events per second received, and for each consumer the lag between
+// the oldest event arriving and the consumer getting to it, and how long the consumer took.
+class EventPipeline {
+    public:
+        using Clock = EventBatch::Clock;
+        using Consumer = std::function<void(const EventBatch&)>;
+
+        EventPipeline() : last_log_(Clock::now()) {}
+
+    //Consumers run in the order they were added
+    void AddConsumer(const std::string& name, Consumer consumer) {
+        consumers_.push_back(Entry{name, std::move(consumer)});
+    }
+
+    //Called from the OnComponentUpdate<deer::Dialogue> callback
+    void Append(const worker::ComponentUpdateOp<deer::Dialogue>& op) {
+        auto now = Clock::now();
+        for (const auto& event : op.Update.said_something()) {
+            auto offset = static_cast<std::uint32_t>(batch_.message_bytes_.size());
+            batch_.message_bytes_.append(event.message());
+            batch_.Append(op.EntityId, kSaidSomething, offset, static_cast<std::uint32_t>(event.message().size()), now);
+        }
+    }
+
+    //Called from the OnComponentUpdate<deer::Health> callback
+    void Append(const worker::ComponentUpdateOp<deer::Health>& op) {
+        auto now = Clock::now();
+        for (const auto& event : op.Update.recovered()) {
+            batch_.Append(op.EntityId, kRecovered, event.amount(), 0, now);
+        }
+    }
+
+    //Runs every consumer over the events received since the last call, then clears the batch.
+    //Call once per tick after view.Process.
+    void Dispatch() {
+        using Milliseconds = std::chrono::duration<double, std::milli>;
+        std::size_t events = batch_.Size();
+
+        auto now = Clock::now();
+        double seconds = std::chrono::duration<double>(now - last_log_).count();
+        std::cout << "[local] Event pipeline: " << events << " events, " << events / seconds << " events/s" << std::endl;
+        last_log_ = now;
+
+        if (events == 0) {
+            return;
+        }
+
+        //Events are appended in arrival order
+        auto oldest = batch_.received_at_.front();
+        for (const auto& entry : consumers_) {
+            auto start = Clock::now();
+            entry.consumer(batch_);
+            auto end = Clock::now();
+            std::cout << "[local] Consumer " << entry.name << ": lag " << Milliseconds(start - oldest).count()
+                      << " ms, took " << Milliseconds(end - start).count() << " ms" << std::endl;
+        }
+
+        batch_.Clear();
+    }
+
+    private:
+        struct Entry {
+            std::string name;
+            Consumer consumer;
+        };
+
+        EventBatch batch_;
+        std::vector<Entry> consumers_;
+        Clock::time_point last_log_;
+};
+
+#endif
@@ -8,6 +8,11 @@
 #include <thread>
 #include <deer.h>
 #include <hunter.h>
+#include <trace.h>
+#include <allocation_counter.h>
+#include <aggregate.h>
+#include "command_latency.h"
+#include "event_pipeline.h"
 
 // Use this to make a worker::ComponentRegistry.
 // For example use worker::Components<improbable::Position, improbable::Metadata> to track these common components
@@ -35,7 +40,8 @@ worker::Connection ConnectWithReceptionist(const std::string hostname,
     return future.Get();
 }
 
-std::string get_random_characters(size_t count) {
+//Overwrites str in place, keeping its length, so it can be reused without allocating
+void fill_random_characters(std::string& str) {
     const auto randchar = []() -> char {
         const char charset[] =
             "0123456789"
@@ -44,12 +50,16 @@ std::string get_random_characters(size_t count) {
         const auto max_index = sizeof(charset) - 1;
         return charset[std::rand() % max_index];
     };
+    std::generate(str.begin(), str.end(), randchar);
+}
+
+std::string get_random_characters(size_t count) {
     std::string str(count, 0);
-    std::generate_n(str.begin(), count, randchar);
+    fill_random_characters(str);
     return str;
 }
 
-void SendDeerCommandRequest(worker::Connection& connection, worker::View& view) {
+void SendDeerCommandRequest(worker::Connection& connection, worker::View& view, CommandLatency& latency) {
     const worker::Option<uint32_t> timeout_ms {1000};
 
     for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
@@ -60,6 +70,7 @@ void SendDeerCommandRequest(worker::Connection& connection, worker::View& view)
             {}
         );
 
+        latency.Sent(request.GetValue().Id);
         std::cout << "Command sent: " << request.GetValue().Id << std::endl;
     }
 }
@@ -81,15 +92,18 @@ int main(int argc, char** argv) {
         std::cout << std::endl;
         std::cout << "    <worker_id>     - (optional) name of the worker assigned by SpatialOS." << std::endl;
         std::cout << std::endl;
+        std::cout << "Tracing options:" << std::endl;
+        std::cout << "    --trace_frames=<N>        - record the last N frames, dumped on exit or SIGUSR1." << std::endl;
+        std::cout << "    --trace_slow_tick_ms=<ms> - dump the recorded frames when a frame takes longer than <ms>." << std::endl;
+        std::cout << "    --trace_file=<path>       - file the Chrome trace-event JSON is written to." << std::endl;
     };
 
-    std::vector<std::string> arguments;
+    std::vector<std::string> arguments(argv + 1, argv + argc);
+    trace::ConsumeFlags(arguments, "myWorker_trace.json");
 
     // if no arguments are supplied, use the defaults for a local deployment
-    if (argc == 1) {
+    if (arguments.empty()) {
         arguments = { "receptionist", "localhost", "7777" };
-    } else {
-        arguments = std::vector<std::string>(argv + 1, argv + argc);
     }
 
     if (arguments.size() != 4 && arguments.size() != 3) {
@@ -124,12 +138,14 @@ int main(int argc, char** argv) {
     bool is_connected = connection.IsConnected();
 
     view.OnDisconnect([&](const worker::DisconnectOp& op) {
+        trace::Scope scope("OnDisconnect", "callback");
         std::cerr << "[disconnect] " << op.Reason << std::endl;
         is_connected = false;
     });
 
     // Print log messages received from SpatialOS
     view.OnLogMessage([&](const worker::LogMessageOp& op) {
+        trace::Scope scope("OnLogMessage", "callback");
         if (op.Level == worker::LogLevel::kFatal) {
             std::cerr << "Fatal error: " << op.Message << std::endl;
             std::terminate();
@@ -137,30 +153,60 @@ int main(int argc, char** argv) {
         std::cout << "[remote] " << op.Message << std::endl;
     });
 
+    //Deer events are only collected during view.Process, the consumers below handle them
+    //in one pass once processing is done
+    EventPipeline event_pipeline;
+
     //Doesn't work
     //Process any deer::SaidSomething events, part of the deer::Dialogue component
     view.OnComponentUpdate<deer::Dialogue>(
-        [](const worker::ComponentUpdateOp<deer::Dialogue>& op) {
-            std::cout << "Processing event ops..." << std::endl;
-            //op.Update.said_something will contain a list of all SaidSomething events
-            for (auto it : op.Update.said_something()) {
-                std::cout << "Deer dialogue event: " << it.message() << std::endl;
-            }
+        [&event_pipeline](const worker::ComponentUpdateOp<deer::Dialogue>& op) {
+            trace::Scope scope("OnComponentUpdate<deer::Dialogue>", "callback");
+            event_pipeline.Append(op);
         }
     );
 
     //Doesn't work
     view.OnComponentUpdate<deer::Health>(
-        [](const worker::ComponentUpdateOp<deer::Health>& op) {
-            std::cout << "Processing event ops..." << std::endl;
-            for (auto it : op.Update.recovered()) {
-                std::cout << "Deer health recovered: " << it.amount() << std::endl;
-            }
+        [&event_pipeline](const worker::ComponentUpdateOp<deer::Health>& op) {
+            trace::Scope scope("OnComponentUpdate<deer::Health>", "callback");
+            event_pipeline.Append(op);
         }
     );
 
+    event_pipeline.AddConsumer("dialogue", [](const EventBatch& batch) {
+        for (std::size_t i = 0; i < batch.Size(); i++) {
+            if (batch.Type(i) == kSaidSomething) {
+                std::cout << "Deer dialogue event: ";
+                std::cout.write(batch.MessageData(i), batch.MessageSize(i)) << std::endl;
+            }
+        }
+    });
+
+    //Total recovered per deer this tick, sorted by entity ID and reused every tick
+    std::vector<std::pair<worker::EntityId, std::uint64_t>> recovered_by_entity;
+
+    event_pipeline.AddConsumer("recovered", [&recovered_by_entity](const EventBatch& batch) {
+        recovered_by_entity.clear();
+        for (std::size_t i = 0; i < batch.Size(); i++) {
+            if (batch.Type(i) == kRecovered) {
+                recovered_by_entity.emplace_back(batch.EntityId(i), batch.Amount(i));
+            }
+        }
+        aggregate::SumByKey(recovered_by_entity);
+
+        for (const auto& entry : recovered_by_entity) {
+            std::cout << "Deer # " << entry.first << " health recovered: " << entry.second << std::endl;
+        }
+    });
+
+    //Round trip of every GotShot request, from sending it to receiving its response
+    CommandLatency got_shot_latency("GotShot");
+
     view.OnCommandResponse<deer::Health::Commands::GotShot>(
-        [](const worker::CommandResponseOp<deer::Health::Commands::GotShot>& op) {
+        [&got_shot_latency](const worker::CommandResponseOp<deer::Health::Commands::GotShot>& op) {
+            trace::Scope scope("OnCommandResponse<deer::Health::Commands::GotShot>", "callback");
+            got_shot_latency.Received(op.RequestId.Id, op.StatusCode);
             std::cout << "Received response for command: " << op.RequestId.Id << std::endl;
         }
     );
@@ -171,32 +217,58 @@ int main(int argc, char** argv) {
 
     std::cout << "[local] Starting game loop!" << std::endl;
 
+    //Reused every tick, the names are rewritten in place
     hunter::Name::Update hunter_name_update;
+    hunter_name_update.set_first_name(std::string(5, 0));
+    hunter_name_update.set_last_name(std::string(8, 0));
+    allocation_counter::TickCheck allocation_check;
 
     //This is the game loop :)
     while (is_connected) {
+        trace::BeginFrame();
+
         //dispatcher.Process(connection.GetOpList(kGetOpListTimeoutInMilliseconds));
         //The ops list is so the connection doesn't time out
+        trace::Scope get_op_list_scope("GetOpList");
         auto ops = connection.GetOpList(kGetOpListTimeoutInMilliseconds);
+        get_op_list_scope.End();
 
         //Process ops so entities and components get added automatically
+        trace::Scope process_scope("view.Process");
         view.Process(ops);
+        process_scope.End();
+
+        allocation_check.Begin();
 
+        trace::Scope events_scope("Event pipeline");
+        event_pipeline.Dispatch();
+        events_scope.End();
+
+        trace::Scope entity_loop_scope("Entity loop");
         for (auto it = view.Entities.begin(); it != view.Entities.end(); it++) {
             auto entity_id = it -> first;
 
-            hunter_name_update.set_first_name(get_random_characters(5));
-            hunter_name_update.set_last_name(get_random_characters(8));
+            fill_random_characters(*hunter_name_update.first_name());
+            fill_random_characters(*hunter_name_update.last_name());
 
             connection.SendComponentUpdate<hunter::Name>(entity_id, hunter_name_update);
         }
+        entity_loop_scope.End();
+
+        trace::Scope send_scope("SendDeerCommandRequest");
+        SendDeerCommandRequest(connection, view, got_shot_latency);
+        send_scope.End();
+
+        got_shot_latency.Log();
 
-        SendDeerCommandRequest(connection, view);
+        allocation_check.End(view.Entities.size());
+        trace::EndFrame();
 
         //Now go to sleep for a bit to avoid excess changes
         std::this_thread::sleep_for(std::chrono::seconds(5));
     }
 
+    trace::Flush();
     return ErrorExitStatus;
 }
 